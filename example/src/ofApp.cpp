@@ -34,6 +34,9 @@ void ofApp::setup()
                                                     tileProvider,
                                                     bufferCache);
 
+    // Keep only textures; pixels are decoded again from the cache if needed.
+    tileSet->setTileResidency(ofxMaps::Tile::Residency::TEXTURE);
+
     tileLayer = std::make_shared<ofxMaps::MapTileLayer>(tileSet, 1 * 1920, 1 * 1080);
 
     ofxGeo::Coordinate chicago(41.8827, -87.6233);
@@ -80,6 +83,7 @@ void ofApp::draw()
 //    cam.end();
 
     ofDrawBitmapStringHighlight(tileLayer->getCenter().toString(0), 14, ofGetHeight() - 32);
+    ofDrawBitmapStringHighlight("Tile Set: " + tileSet->toString(), 14, ofGetHeight() - 48);
     ofDrawBitmapStringHighlight("Task Queue:" + ofx::TaskQueue::instance().toString(), 14, ofGetHeight() - 16);
     ofDrawBitmapStringHighlight("Connection Pool: " + bufferCache->toString(), 14, ofGetHeight() - 2);
 
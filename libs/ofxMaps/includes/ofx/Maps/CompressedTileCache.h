@@ -0,0 +1,146 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "ofFileUtils.h"
+#include "ofx/Maps/Tile.h"
+#include "ofx/Maps/TileFreshness.h"
+#include "ofx/Maps/TileKey.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief An in-memory LRU cache of encoded tile bytes, bounded in bytes.
+///
+/// This sits between the decoded tiles held by a MapTileSet and the disk
+/// cache. Encoded tiles are many times smaller than decoded pixels, so many
+/// more of them fit in the same memory, and a tile evicted from the decoded
+/// tier can be decoded again without a disk read. Each tile's freshness is
+/// held with it so stale tiles are still revalidated.
+class CompressedTileCache
+{
+public:
+    /// \brief Create a CompressedTileCache.
+    /// \param maxBytes The maximum number of encoded bytes to hold.
+    CompressedTileCache(uint64_t maxBytes = DEFAULT_MAX_BYTES);
+
+    /// \brief Destroy the CompressedTileCache.
+    ~CompressedTileCache();
+
+    /// \brief Get a tile's encoded bytes, marking it most recently used.
+    /// \param key The tile key.
+    /// \param freshness If not nullptr, filled with the tile's freshness.
+    /// \returns the encoded bytes or nullptr if not held.
+    std::shared_ptr<ofBuffer> get(const TileKey& key,
+                                  TileFreshness* freshness = nullptr);
+
+    /// \brief Add a tile's encoded bytes, evicting the least recently used
+    /// tiles if the budget is exceeded.
+    /// \param key The tile key.
+    /// \param buffer The encoded bytes.
+    /// \param freshness The tile's freshness.
+    void add(const TileKey& key,
+             std::shared_ptr<ofBuffer> buffer,
+             const TileFreshness& freshness = TileFreshness());
+
+
+    /// \brief Remove a tile.
+    /// \param key The tile key.
+    void remove(const TileKey& key);
+
+    /// \brief Remove all tiles.
+    void clear();
+
+    /// \brief Set the maximum number of encoded bytes to hold.
+    /// \param maxBytes The maximum number of bytes, or 0 to disable the cache.
+    void setMaxBytes(uint64_t maxBytes);
+
+    /// \returns the maximum number of encoded bytes to hold.
+    uint64_t getMaxBytes() const;
+
+    /// \returns the number of encoded bytes held.
+    uint64_t usedBytes() const;
+
+    /// \returns the number of tiles held.
+    std::size_t size() const;
+
+    /// \returns the number of lookups that found a tile.
+    uint64_t numHits() const;
+
+    /// \returns the number of lookups that did not find a tile.
+    uint64_t numMisses() const;
+
+    /// \brief Set the totals the held bytes are counted in.
+    /// \param stats The memory totals, or nullptr.
+    void setMemoryStats(std::shared_ptr<TileMemoryStats> stats);
+
+    /// \returns a debug string.
+    std::string toString() const;
+
+    enum
+    {
+        /// \brief The default maximum number of encoded bytes to hold.
+        DEFAULT_MAX_BYTES = 32 * 1024 * 1024
+    };
+
+private:
+    /// \brief A held tile.
+    struct Entry
+    {
+        /// \brief The tile key.
+        TileKey key;
+
+        /// \brief The encoded bytes.
+        std::shared_ptr<ofBuffer> buffer;
+
+        /// \brief The tile's freshness.
+        TileFreshness freshness;
+    };
+
+    /// \brief Remove an entry, updating the byte counts.
+    /// \param iter The entry to remove.
+    void _erase(std::list<Entry>::iterator iter);
+
+    /// \brief Evict least recently used entries until within the budget.
+    void _evict();
+
+    /// \brief The entries, most recently used first.
+    std::list<Entry> _entries;
+
+    /// \brief The entries, by key.
+    std::map<TileKey, std::list<Entry>::iterator> _index;
+
+    /// \brief The maximum number of encoded bytes to hold.
+    uint64_t _maxBytes = DEFAULT_MAX_BYTES;
+
+    /// \brief The number of encoded bytes held.
+    uint64_t _usedBytes = 0;
+
+    /// \brief The number of lookups that found a tile.
+    uint64_t _numHits = 0;
+
+    /// \brief The number of lookups that did not find a tile.
+    uint64_t _numMisses = 0;
+
+    /// \brief The memory totals the held bytes are counted in, if any.
+    std::shared_ptr<TileMemoryStats> _memoryStats;
+
+    /// \brief The mutex protecting the cache.
+    mutable std::mutex _mutex;
+
+};
+
+
+} } // namespace ofx::Maps
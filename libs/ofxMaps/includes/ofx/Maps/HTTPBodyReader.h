@@ -0,0 +1,72 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <istream>
+#include <memory>
+#include <string>
+#include "Poco/Net/HTTPResponse.h"
+#include "ofFileUtils.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief Reads HTTP response bodies without iostream buffering.
+///
+/// Bodies are read in large chunks directly into an ofBuffer's storage. When
+/// the response has a Content-Length, the buffer is allocated once at its
+/// final size.
+class HTTPBodyReader
+{
+public:
+    /// \brief Read a response body.
+    ///
+    /// If the body is truncated or larger than the maximum size, nullptr is
+    /// returned and the session should not be reused.
+    ///
+    /// \param response The response whose headers describe the body.
+    /// \param stream The response body stream.
+    /// \param maxSize The maximum body size in bytes.
+    /// \returns the body or nullptr on failure.
+    static std::shared_ptr<ofBuffer> read(const Poco::Net::HTTPResponse& response,
+                                          std::istream& stream,
+                                          std::size_t maxSize = DEFAULT_MAX_BODY_SIZE);
+
+    /// \brief Read and discard a response body.
+    ///
+    /// At most the maximum size is read, so a large error page cannot hold
+    /// up the caller. If the body is larger, the rest is left unread and the
+    /// session should not be reused.
+    ///
+    /// \param stream The response body stream.
+    /// \param prefix If not nullptr, filled with the start of the body.
+    /// \param maxSize The maximum number of bytes to read.
+    /// \returns true if the whole body was read.
+    static bool discard(std::istream& stream,
+                        std::string* prefix = nullptr,
+                        std::size_t maxSize = DEFAULT_MAX_DISCARD_SIZE);
+
+    enum
+    {
+        /// \brief The size of each read when the length is unknown.
+        DEFAULT_CHUNK_SIZE = 64 * 1024,
+        /// \brief The default maximum body size in bytes.
+        DEFAULT_MAX_BODY_SIZE = 16 * 1024 * 1024,
+        /// \brief The default maximum number of bytes read from a discarded body.
+        DEFAULT_MAX_DISCARD_SIZE = 64 * 1024,
+        /// \brief The maximum number of bytes kept from a discarded body.
+        MAX_PREFIX_SIZE = 512
+    };
+
+};
+
+
+} } // namespace ofx::Maps
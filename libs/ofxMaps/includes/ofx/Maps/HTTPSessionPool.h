@@ -0,0 +1,138 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Poco/URI.h"
+#include "ofx/HTTP/Client.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief A pool of keep-alive HTTP sessions, grouped by scheme, host and port.
+///
+/// Each session owns an HTTP::Client and HTTP::Context. The context keeps its
+/// client session open between requests, so reusing a session avoids a new
+/// TCP connection and TLS handshake for every tile. The number of sessions
+/// per host is limited. Borrowing blocks until a session is free.
+class HTTPSessionPool
+{
+public:
+    /// \brief A reusable client and context for a single host.
+    class Session
+    {
+    public:
+        /// \brief Create a Session for the given host key.
+        /// \param hostKey The scheme, host and port key.
+        Session(const std::string& hostKey);
+
+        /// \returns the scheme, host and port key for this session.
+        const std::string& hostKey() const;
+
+        /// \brief The client used to execute requests.
+        HTTP::Client client;
+
+        /// \brief The context holding the persistent client session.
+        HTTP::Context context;
+
+    private:
+        /// \brief The scheme, host and port key.
+        std::string _hostKey;
+
+    };
+
+    /// \brief Create an HTTPSessionPool.
+    /// \param maxSessionsPerHost The maximum number of sessions per host.
+    HTTPSessionPool(std::size_t maxSessionsPerHost = DEFAULT_MAX_SESSIONS_PER_HOST);
+
+    /// \brief Destroy the HTTPSessionPool.
+    ~HTTPSessionPool();
+
+    /// \brief Borrow a session for the given URI's host.
+    ///
+    /// Blocks until a session is available.
+    ///
+    /// \param uri The URI that will be requested.
+    /// \returns a session for the URI's host.
+    std::unique_ptr<Session> borrowSession(const Poco::URI& uri);
+
+    /// \brief Return a borrowed session to the pool.
+    ///
+    /// A session should only be reused if its last response body was read
+    /// completely and no error occurred.
+    ///
+    /// \param session The session to return.
+    /// \param reusable True if the session can be used again.
+    void returnSession(std::unique_ptr<Session> session, bool reusable);
+
+    /// \brief Set the maximum number of sessions per host.
+    /// \param maxSessionsPerHost The maximum number of sessions per host.
+    void setMaxSessionsPerHost(std::size_t maxSessionsPerHost);
+
+    /// \returns the maximum number of sessions per host.
+    std::size_t getMaxSessionsPerHost() const;
+
+    /// \brief Close all idle sessions.
+    void clear();
+
+    /// \returns a debug string.
+    std::string toString() const;
+
+    /// \brief Get the key used to group sessions for a URI.
+    /// \param uri The URI.
+    /// \returns the scheme, host and port key.
+    static std::string hostKey(const Poco::URI& uri);
+
+    enum
+    {
+        /// \brief The default maximum number of sessions per host.
+        ///
+        /// Many tile servers ask clients to keep this low.
+        DEFAULT_MAX_SESSIONS_PER_HOST = 4
+    };
+
+private:
+    /// \brief The sessions for a single host.
+    struct Host
+    {
+        /// \brief The number of borrowed sessions.
+        std::size_t numBorrowed = 0;
+
+        /// \brief The idle sessions ready for reuse.
+        std::vector<std::unique_ptr<Session>> idle;
+    };
+
+    /// \brief The maximum number of sessions per host.
+    std::size_t _maxSessionsPerHost = DEFAULT_MAX_SESSIONS_PER_HOST;
+
+    /// \brief The number of sessions created.
+    uint64_t _numCreated = 0;
+
+    /// \brief The number of times an idle session was reused.
+    uint64_t _numReused = 0;
+
+    /// \brief The hosts, by key.
+    std::map<std::string, Host> _hosts;
+
+    /// \brief Signaled when a session is returned.
+    std::condition_variable _condition;
+
+    /// \brief The mutex protecting the pool.
+    mutable std::mutex _mutex;
+
+};
+
+
+} } // namespace ofx::Maps
@@ -0,0 +1,172 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include "Poco/Net/HTTPResponse.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief Limits the request rate and concurrency to each tile host.
+///
+/// Each host has a token bucket limiting requests per second and a limit on
+/// requests in flight. The in-flight limit adapts: it grows by one for each
+/// window of successful requests and halves when the host throttles, slows
+/// down or fails. A Retry-After header pauses all requests to the host for
+/// the time it asks for.
+class HostRateLimiter
+{
+public:
+    /// \brief The outcome of a request, used to adapt the limits.
+    enum class Outcome
+    {
+        /// \brief The host answered normally.
+        SUCCESS,
+        /// \brief The host asked the client to slow down, e.g. 429 or 503.
+        THROTTLED,
+        /// \brief The request failed, e.g. a timeout or connection error.
+        FAILED
+    };
+
+    /// \brief Create a HostRateLimiter.
+    /// \param requestsPerSecond The maximum sustained requests per second
+    ///        per host.
+    /// \param maxInFlight The most requests in flight per host.
+    HostRateLimiter(double requestsPerSecond = DEFAULT_REQUESTS_PER_SECOND,
+                    std::size_t maxInFlight = DEFAULT_MAX_IN_FLIGHT);
+
+    /// \brief Wait until a request to the host is allowed.
+    ///
+    /// Every call must be matched by a call to release().
+    ///
+    /// \param hostKey The scheme, host and port of the request.
+    void acquire(const std::string& hostKey);
+
+    /// \brief Finish a request and adapt the host's limits.
+    /// \param hostKey The scheme, host and port of the request.
+    /// \param outcome The outcome of the request.
+    /// \param milliseconds The time taken by the request.
+    /// \param retryAfterSeconds Seconds the host asked to wait, or 0.
+    /// \param isLatencySample True if the request returned a full tile body.
+    ///        Only these update the host's latency baseline, since cheap
+    ///        answers like 304 and 404 would drag it below a normal tile.
+    void release(const std::string& hostKey,
+                 Outcome outcome,
+                 double milliseconds,
+                 double retryAfterSeconds = 0,
+                 bool isLatencySample = false);
+
+    /// \brief Set the maximum sustained requests per second per host.
+    /// \param requestsPerSecond The rate, or 0 for no rate limit.
+    void setRequestsPerSecond(double requestsPerSecond);
+
+    /// \returns the maximum sustained requests per second per host.
+    double getRequestsPerSecond() const;
+
+    /// \brief Set the most requests in flight per host.
+    /// \param maxInFlight The maximum concurrency.
+    void setMaxInFlight(std::size_t maxInFlight);
+
+    /// \returns the most requests in flight per host.
+    std::size_t getMaxInFlight() const;
+
+    /// \returns a debug string with each host's current limits.
+    std::string toString() const;
+
+    /// \brief Get the outcome of a response for rate limiting.
+    /// \param response The response.
+    /// \returns THROTTLED for 429 and 503, FAILED for other server errors,
+    ///          otherwise SUCCESS.
+    static Outcome outcomeFor(const Poco::Net::HTTPResponse& response);
+
+    /// \brief Parse a response's Retry-After header.
+    ///
+    /// Both the delay-seconds and HTTP-date forms are accepted.
+    ///
+    /// \param response The response.
+    /// \returns the seconds to wait, or 0 if there is no valid header.
+    static double retryAfterSeconds(const Poco::Net::HTTPResponse& response);
+
+    enum
+    {
+        /// \brief The default maximum sustained requests per second per host.
+        DEFAULT_REQUESTS_PER_SECOND = 20,
+        /// \brief The default most requests in flight per host.
+        ///
+        /// This matches HTTPSessionPool::DEFAULT_MAX_SESSIONS_PER_HOST.
+        DEFAULT_MAX_IN_FLIGHT = 4,
+        /// \brief The seconds to back off after throttling without Retry-After.
+        DEFAULT_THROTTLE_BACKOFF = 1,
+        /// \brief The number of latency samples averaged into the baseline.
+        LATENCY_BASELINE_WINDOW = 20
+    };
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    /// \brief The limits and state for a single host.
+    struct Host
+    {
+        /// \brief The tokens available in the bucket.
+        double tokens = 0;
+
+        /// \brief The last time tokens were added.
+        Clock::time_point lastRefill;
+
+        /// \brief The current adaptive concurrency limit.
+        double limit = 1;
+
+        /// \brief The number of requests in flight.
+        std::size_t inFlight = 0;
+
+        /// \brief A moving average of full tile latency, used as the baseline.
+        ///
+        /// The average follows lasting changes in the host's speed, so a
+        /// single fast response can't hold the limit down forever.
+        double baselineLatency = 0;
+
+        /// \brief No requests are started before this time.
+        Clock::time_point blockedUntil;
+
+        /// \brief The number of times the host throttled requests.
+        uint64_t numThrottled = 0;
+    };
+
+    /// \brief Get or create the state for a host.
+    /// \param hostKey The host key.
+    /// \param now The current time.
+    /// \returns the host state.
+    Host& _host(const std::string& hostKey, Clock::time_point now);
+
+    /// \brief The maximum sustained requests per second per host.
+    double _requestsPerSecond = DEFAULT_REQUESTS_PER_SECOND;
+
+    /// \brief The most requests in flight per host.
+    std::size_t _maxInFlight = DEFAULT_MAX_IN_FLIGHT;
+
+    /// \brief The hosts, by key.
+    std::map<std::string, Host> _hosts;
+
+    /// \brief Signaled when a request finishes or the limits change.
+    std::condition_variable _condition;
+
+    /// \brief The mutex protecting the hosts.
+    mutable std::mutex _mutex;
+
+};
+
+
+} } // namespace ofx::Maps
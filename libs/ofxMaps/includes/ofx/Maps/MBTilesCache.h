@@ -8,6 +8,10 @@
 #pragma once
 
 
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <set>
 #include "Poco/Net/NameValueCollection.h"
 #include "SQLiteCpp.h"
 #include "SQLiteConnection.h"
@@ -20,6 +24,8 @@
 #include "ofx/Maps/Tile.h"
 #include "ofx/Maps/TileKey.h"
 #include "ofx/Maps/TileCoordinate.h"
+#include "ofx/Maps/TileFreshness.h"
+#include "ofx/Maps/TilePresenceIndex.h"
 #include "ofx/Maps/MapTileProvider.h"
 
 
@@ -81,6 +87,40 @@ public:
 class MBTilesConnection: public SQLite::SQLiteConnection
 {
 public:
+    /// \brief A tile key and its encoded image buffer.
+    typedef std::pair<TileKey, std::shared_ptr<ofBuffer>> TileEntry;
+
+    /// \brief A callback receiving a tile key, its buffer and its freshness.
+    ///
+    /// The buffer is nullptr if the tile is not in the database.
+    typedef std::function<void(const TileKey&, std::shared_ptr<ofBuffer>, const TileFreshness&)> TileBufferCallback;
+
+    /// \brief A callback receiving a view of a tile's encoded bytes.
+    ///
+    /// The data is owned by SQLite and is only valid during the call.
+    typedef std::function<bool(const char* data, std::size_t size)> TileDataCallback;
+
+    /// \brief The outcome of an upsertTile() call.
+    enum class UpsertResult
+    {
+        /// \brief The tile was not present and has been inserted.
+        INSERTED,
+        /// \brief The tile was already present and was left unchanged.
+        EXISTS,
+        /// \brief The tile could not be written.
+        FAILED
+    };
+
+    enum
+    {
+        /// \brief The largest gap in Hilbert indices between two keys that
+        /// are still read with one range scan in getBuffers().
+        MAX_HILBERT_GAP = 16,
+        /// \brief The schema version stored in PRAGMA user_version once a
+        /// database has been fully upgraded.
+        SCHEMA_VERSION = 1
+    };
+
     using SQLite::SQLiteConnection::SQLiteConnection;
 
 //    MBTilesConnection(const std::string& filename,
@@ -99,13 +139,161 @@ public:
 
     std::shared_ptr<ofBuffer> getBuffer(const TileKey& key) const noexcept;
 
+    /// \brief Read a tile's encoded bytes without copying them.
+    ///
+    /// The reader is passed a pointer directly into the SQLite blob, which is
+    /// valid only until the reader returns.
+    ///
+    /// \param key The tile key.
+    /// \param reader The callback to receive the tile data.
+    /// \param freshness If not nullptr, filled with the tile's freshness.
+    /// \returns false if the tile does not exist, otherwise the reader result.
+    bool readBuffer(const TileKey& key,
+                    TileDataCallback reader,
+                    TileFreshness* freshness = nullptr) const noexcept;
+
+    /// \brief Get the buffers for a group of tiles.
+    ///
+    /// Keys are sorted along the Hilbert curve and grouped into runs of
+    /// nearby tiles in the same set and zoom. Each run is fetched with a
+    /// single range scan over the (zoom_level, tile_hilbert) index, so a
+    /// rectangular region takes a few scans rather than one per column.
+    /// The callback is called
+    /// once per key as soon as its row is read, so the caller can begin
+    /// decoding before the whole group has been fetched. The callback should
+    /// not throw.
+    ///
+    /// \param keys The tile keys to get.
+    /// \param callback The callback to receive each key and its buffer.
+    void getBuffers(const std::vector<TileKey>& keys,
+                    TileBufferCallback callback) const noexcept;
+
     std::shared_ptr<Tile> getTile(const TileKey& key) const noexcept;
 
+    /// \brief Write a tile if it is not already present.
+    /// \param key The tile key.
+    /// \param image The encoded image.
+    /// \returns true if the tile was inserted or already existed.
     bool setTile(const TileKey& key,
                  const ofBuffer& image) noexcept;
 
+    /// \brief Write a tile if it is not already present.
+    ///
+    /// This uses one insert statement for the image and one for the map,
+    /// relying on the unique indexes rather than a check before each insert.
+    ///
+    /// \param key The tile key.
+    /// \param image The encoded image.
+    /// \param freshness The HTTP freshness information to store.
+    /// \returns whether the tile was inserted, already existed or failed.
+    UpsertResult upsertTile(const TileKey& key,
+                            const ofBuffer& image,
+                            const TileFreshness& freshness = TileFreshness()) noexcept;
+
+    /// \brief Write a group of tiles in a single transaction.
+    ///
+    /// Tiles that already exist are left unchanged. If the transaction cannot be
+    /// committed, none of the tiles are written.
+    ///
+    /// \param tiles The tiles to write.
+    /// \returns the number of tiles inserted.
+    std::size_t setTiles(const std::vector<TileEntry>& tiles) noexcept;
+
     std::size_t size() const noexcept;
 
+    /// \brief Build a presence index of all tiles in the map table.
+    ///
+    /// The index is sized to leave room for new tiles.
+    ///
+    /// \returns the presence index, or nullptr on failure.
+    std::unique_ptr<TilePresenceIndex> buildPresenceIndex() const noexcept;
+
+    /// \brief Mark a tile as recently used.
+    /// \param key The tile key.
+    /// \returns true if the access time was updated.
+    bool touchTile(const TileKey& key) noexcept;
+
+    /// \brief Update a tile's freshness after a successful revalidation.
+    ///
+    /// Validators that are empty in the given freshness are left unchanged.
+    ///
+    /// \param key The tile key.
+    /// \param freshness The new freshness information.
+    /// \returns true if the tile was updated.
+    bool refreshTile(const TileKey& key,
+                     const TileFreshness& freshness) noexcept;
+
+    /// \brief Record that the server does not have a tile.
+    /// \param key The tile key.
+    /// \param expiresDate The Unix time after which the tile may be retried.
+    /// \returns true if the record was written.
+    bool setMissing(const TileKey& key, int64_t expiresDate) noexcept;
+
+    /// \brief Determine if a tile is recorded as missing.
+    /// \param key The tile key.
+    /// \param now The current Unix time.
+    /// \param expiresDate If not nullptr, filled with the Unix time after
+    ///        which the tile may be retried.
+    /// \returns true if the tile is missing and the record has not expired.
+    bool isMissing(const TileKey& key,
+                   int64_t now,
+                   int64_t* expiresDate = nullptr) const noexcept;
+
+    /// \brief Remove a tile's missing record, if any.
+    /// \param key The tile key.
+    /// \returns true if successful.
+    bool removeMissing(const TileKey& key) noexcept;
+
+    /// \brief Remove all missing records that have expired.
+    /// \param now The current Unix time.
+    /// \returns the number of records removed.
+    std::size_t removeExpiredMissing(int64_t now) noexcept;
+
+    /// \brief Remove a tile and garbage collect its image if unused.
+    ///
+    /// A key with an empty set id removes the tile from every set.
+    ///
+    /// \param key The tile key.
+    /// \returns true if the tile was removed or did not exist.
+    bool removeTile(const TileKey& key) noexcept;
+
+    /// \brief Evict the least recently used tiles in a single transaction.
+    ///
+    /// Images that are no longer referenced are removed with their tiles.
+    ///
+    /// \param count The maximum number of tiles to evict.
+    /// \returns the number of tiles evicted.
+    std::size_t evictTiles(std::size_t count) noexcept;
+
+    /// \brief Remove all tiles and images.
+    /// \returns true if successful.
+    bool clear() noexcept;
+
+    /// \brief Return up to the given number of free pages to the file system.
+    ///
+    /// This has no effect unless the database uses incremental auto vacuum.
+    ///
+    /// \param maxPages The maximum number of pages to free.
+    void incrementalVacuum(std::size_t maxPages) noexcept;
+
+    /// \returns the number of bytes in use by database pages.
+    uint64_t usedBytes() const noexcept;
+
+    /// \brief Add any missing columns to a database created by an older version.
+    ///
+    /// Tiles written before the tile_hilbert column existed have it filled in
+    /// once, after which the database is marked with SCHEMA_VERSION so later
+    /// opens skip the scan.
+    ///
+    /// \returns true if successful.
+    bool upgradeSchema() noexcept;
+
+    /// \brief Determine if a table has a given column.
+    /// \param table The table name.
+    /// \param column The column name.
+    /// \returns true if the column exists.
+    bool hasColumn(const std::string& table, const std::string& column) const noexcept;
+
     static const std::string QUERY_SELECT_METADATA;
     static const std::string QUERY_INSERT_METADATA;
     static const std::string CREATE_TABLE_METADATA;
@@ -113,6 +301,10 @@ public:
 
     static const std::string QUERY_TILES;
     static const std::string QUERY_TILES_WITH_SET_ID;
+    static const std::string QUERY_TILES_WITH_FRESHNESS;
+    static const std::string QUERY_TILES_WITH_FRESHNESS_WITH_SET_ID;
+    static const std::string QUERY_TILE_HILBERT_RANGE;
+    static const std::string QUERY_TILE_HILBERT_RANGE_WITH_SET_ID;
     static const std::string COUNT_TILES;
     static const std::string COUNT_TILES_WITH_SET_ID;
 
@@ -126,8 +318,43 @@ public:
 
     static const std::string COUNT_ALL;
 
+    static const std::string QUERY_MAP_KEYS;
+    static const std::string COUNT_MAP_KEYS;
+
+    static const std::string TOUCH_MAP;
+    static const std::string TOUCH_MAP_WITH_SET_ID;
+    static const std::string REFRESH_MAP;
+    static const std::string REFRESH_MAP_WITH_SET_ID;
+    static const std::string QUERY_MAP_ROWS;
+    static const std::string QUERY_MAP_ROWS_WITH_SET_ID;
+    static const std::string QUERY_MAP_ROWS_WITHOUT_HILBERT;
+    static const std::string UPDATE_MAP_HILBERT;
+    static const std::string QUERY_LEAST_RECENTLY_USED_MAP_ROWS;
+    static const std::string DELETE_MAP_ROW;
+    static const std::string DELETE_UNUSED_IMAGE;
+    static const std::string DELETE_ALL_MAP;
+    static const std::string DELETE_ALL_IMAGES;
+
+    static const std::string INSERT_MISSING;
+    static const std::string QUERY_MISSING;
+    static const std::string DELETE_MISSING;
+    static const std::string DELETE_EXPIRED_MISSING;
+    static const std::string DELETE_ALL_MISSING;
+
     static const std::string MBTILES_SCHEMA;
 
+private:
+    /// \brief Fill in tile_hilbert for tiles written before it existed.
+    void _backfillHilbert();
+
+    /// \brief Delete the map rows selected by a (rowid, tile_id) query.
+    ///
+    /// Images that are no longer referenced by any map row are also deleted.
+    ///
+    /// \param query The query selecting the rows to delete.
+    /// \returns the number of map rows deleted.
+    std::size_t _deleteMapRows(SQLite::Statement& query);
+
 };
 
 
@@ -143,9 +370,122 @@ public:
                  std::size_t peakCapacity = MBTilesConnectionPool::DEFAULT_PEAK_CAPACITY);
 
     virtual ~MBTilesCache();
+
+    /// \brief Set the maximum number of tiles committed in one transaction.
+    ///
+    /// A batch size of 1 commits each tile on its own.
+    ///
+    /// \param writeBatchSize The maximum number of tiles per transaction.
+    void setWriteBatchSize(std::size_t writeBatchSize);
+
+    /// \returns the maximum number of tiles committed in one transaction.
+    std::size_t getWriteBatchSize() const;
+
+    /// \brief Set the time the writer waits to fill a batch.
+    ///
+    /// After receiving the first tile of a batch, the writer will wait up to
+    /// this long for more tiles before committing.
+    ///
+    /// \param writeBatchIntervalMilliseconds The batch window in milliseconds.
+    void setWriteBatchInterval(uint64_t writeBatchIntervalMilliseconds);
+
+    /// \returns the batch window in milliseconds.
+    uint64_t getWriteBatchInterval() const;
+
+    /// \brief Set the maximum size of the cache database in bytes.
+    ///
+    /// When the database grows beyond this size, the least recently used
+    /// tiles are evicted by the writer thread until it is back under budget.
+    /// Freed pages are returned to the file system with incremental vacuum.
+    /// Access times are only tracked while a budget is set. A size of 0
+    /// disables eviction.
+    ///
+    /// \param maxBytes The maximum size in bytes.
+    void setMaxBytes(uint64_t maxBytes);
+
+    /// \returns the maximum size of the cache database in bytes.
+    uint64_t getMaxBytes() const;
+
+    /// \returns the number of bytes in use by the cache database.
+    uint64_t usedBytes() const;
+
+    enum
+    {
+        /// \brief The default maximum number of tiles per write transaction.
+        DEFAULT_WRITE_BATCH_SIZE = 256,
+        /// \brief The default write batch window in milliseconds.
+        DEFAULT_WRITE_BATCH_INTERVAL = 250,
+        /// \brief The number of tiles evicted per eviction transaction.
+        EVICTION_BATCH_SIZE = 256,
+        /// \brief The maximum number of eviction transactions per write batch.
+        MAX_EVICTION_PASSES = 16,
+        /// \brief The maximum number of pages vacuumed after eviction.
+        MAX_VACUUM_PAGES = 1024
+    };
     
     const MBTilesConnectionPool& readConnectionPool() const;
 
+    /// \brief Get the buffers for a group of tiles using one connection.
+    ///
+    /// Tiles the presence index rules out are reported without a query. The
+    /// rest are read with MBTilesConnection::getBuffers() and reported as
+    /// each row arrives.
+    ///
+    /// \param keys The tile keys to get.
+    /// \param callback The callback to receive each key and its buffer.
+    /// \sa MBTilesConnection::getBuffers()
+    void getMany(const std::vector<TileKey>& keys,
+                 MBTilesConnection::TileBufferCallback callback) const;
+
+    /// \brief Read a tile's encoded bytes without copying them.
+    /// \param key The tile key.
+    /// \param reader The callback to receive the tile data.
+    /// \param freshness If not nullptr, filled with the tile's freshness.
+    /// \returns false if the tile does not exist, otherwise the reader result.
+    /// \sa MBTilesConnection::readBuffer()
+    bool read(const TileKey& key,
+              MBTilesConnection::TileDataCallback reader,
+              TileFreshness* freshness = nullptr) const;
+
+    using Cache::BaseCache<TileKey, ofBuffer>::add;
+
+    /// \brief Add a tile with its HTTP freshness information.
+    /// \param key The tile key.
+    /// \param entry The encoded image.
+    /// \param freshness The freshness information to store.
+    void add(const TileKey& key,
+             std::shared_ptr<ofBuffer> entry,
+             const TileFreshness& freshness);
+
+    /// \brief Replace a tile after a revalidation returned a new image.
+    /// \param key The tile key.
+    /// \param entry The new encoded image.
+    /// \param freshness The new freshness information.
+    void replace(const TileKey& key,
+                 std::shared_ptr<ofBuffer> entry,
+                 const TileFreshness& freshness);
+
+    /// \brief Update a tile's freshness after a revalidation returned 304.
+    /// \param key The tile key.
+    /// \param freshness The new freshness information.
+    void refresh(const TileKey& key,
+                 const TileFreshness& freshness);
+
+    /// \brief Record that the server does not have a tile.
+    ///
+    /// The record is removed when the tile is added or replaced.
+    ///
+    /// \param key The tile key.
+    /// \param expiresDate The Unix time after which the tile may be retried.
+    void addMissing(const TileKey& key, int64_t expiresDate);
+
+    /// \brief Determine if a tile is recorded as missing on the server.
+    /// \param key The tile key.
+    /// \param expiresDate If not nullptr, filled with the Unix time after
+    ///        which the tile may be retried.
+    /// \returns true if the tile is missing and the record has not expired.
+    bool isMissing(const TileKey& key, int64_t* expiresDate = nullptr) const;
+
     std::string path() const
     {
         return _writeConnection->database().getFilename();
@@ -175,9 +515,76 @@ protected:
     void doClear() override;
 
 private:
+    /// \brief A queued operation for the writer thread.
+    struct WriteRequest
+    {
+        enum class Type
+        {
+            /// \brief Add a tile.
+            ADD,
+            /// \brief Replace a tile's image and freshness.
+            REPLACE,
+            /// \brief Update a tile's freshness.
+            REFRESH,
+            /// \brief Update the access times of all touched tiles.
+            TOUCH,
+            /// \brief Record that a tile is missing on the server.
+            MISSING,
+            /// \brief Remove a tile.
+            REMOVE,
+            /// \brief Remove all tiles.
+            CLEAR
+        };
+
+        Type type = Type::ADD;
+        TileKey key;
+        std::shared_ptr<ofBuffer> buffer = nullptr;
+        TileFreshness freshness;
+    };
+
+    /// \brief Receive and write tiles until the write channel is closed.
+    void _write();
+
+    /// \brief Apply a batch of write requests in a single transaction.
+    /// \param batch The requests to apply.
+    void _applyWriteRequests(const std::vector<WriteRequest>& batch);
+
+    /// \brief Evict least recently used tiles if over the byte budget.
+    void _evict();
+
+    /// \brief Queue an access time update if eviction is enabled.
+    ///
+    /// Touches are collected and written once per key per write batch.
+    ///
+    /// \param key The tile key that was accessed.
+    void _touch(const TileKey& key) const;
+
+    /// \brief Write the access times of all touched tiles.
+    void _flushTouches();
+
+    /// \brief The tiles accessed since the last flush.
+    mutable std::set<TileKey> _touched;
+
+    /// \brief The mutex protecting _touched.
+    mutable std::mutex _touchedMutex;
+
     std::thread _writeThread;
 
-    ofThreadChannel<std::pair<TileKey, std::shared_ptr<ofBuffer>>> _writeChannel;
+    mutable ofThreadChannel<WriteRequest> _writeChannel;
+
+    /// \brief The maximum database size in bytes, or 0 for no limit.
+    std::atomic<uint64_t> _maxBytes;
+
+    /// \brief The maximum number of tiles per write transaction.
+    std::atomic<std::size_t> _writeBatchSize;
+
+    /// \brief The write batch window in milliseconds.
+    std::atomic<uint64_t> _writeBatchInterval;
+
+    /// \brief An index of stored tiles used to skip lookups for missing tiles.
+    ///
+    /// This is nullptr if the index could not be built.
+    std::unique_ptr<TilePresenceIndex> _presenceIndex = nullptr;
 
     std::unique_ptr<MBTilesConnection> _writeConnection = nullptr;
 
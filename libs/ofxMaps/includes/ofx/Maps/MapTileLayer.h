@@ -10,6 +10,8 @@
 
 #include <set>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include "ofBaseTypes.h"
 #include "ofFbo.h"
 #include "ofMath.h"
@@ -17,6 +19,7 @@
 #include "ofx/Maps/TileCoordinate.h"
 #include "ofx/Maps/TileKey.h"
 #include "ofx/Maps/MapTileSet.h"
+#include "ofx/Maps/PackedTileKey.h"
 #include "ofMath.h"
 #include <unordered_map>
 namespace ofx {
@@ -106,6 +109,26 @@ public:
 
     std::string getSetId() const;
 
+    /// \brief Set the maximum number of tile requests queued at once.
+    ///
+    /// Visible tiles beyond this limit wait in the layer and are reprioritized
+    /// each time the center or zoom changes.
+    ///
+    /// \param maxOutstandingRequests The maximum number of queued requests.
+    void setMaxOutstandingRequests(std::size_t maxOutstandingRequests);
+
+    /// \returns the maximum number of tile requests queued at once.
+    std::size_t getMaxOutstandingRequests() const;
+
+    enum
+    {
+        /// \brief The default maximum number of tile requests queued at once.
+        DEFAULT_MAX_OUTSTANDING_REQUESTS = 32,
+        /// \brief The milliseconds before skipped or failed tiles that are
+        /// still missing are requested again.
+        RETRY_INTERVAL = 1000
+    };
+
     TileCoordinate pixelsToTile(const glm::vec2& pixelCoordinate) const;
     glm::vec2 tileToPixels(const TileCoordinate& tileCoordinate) const;
 
@@ -117,17 +140,95 @@ public:
 protected:
 //    virtual void drawMissing(const TileCoordinate& coordinate) const;
 
+    /// \brief A range of tile columns and rows at a single zoom level.
+    struct TileRange
+    {
+        /// \brief The zoom level, or -1 if the range is empty.
+        int zoom = -1;
+
+        /// \brief The first column.
+        int minColumn = 0;
+
+        /// \brief The first row.
+        int minRow = 0;
+
+        /// \brief One past the last column.
+        int maxColumn = 0;
+
+        /// \brief One past the last row.
+        int maxRow = 0;
+
+        /// \returns true if the range contains the column and row.
+        bool contains(int column, int row) const;
+
+        bool operator == (const TileRange& range) const;
+
+        bool operator != (const TileRange& range) const;
+    };
+
     TileKey keyForCoordinate(const TileCoordinate& coordinate) const;
 
+    /// \brief Get the packed key for a coordinate, without copying strings.
+    /// \param coordinate The tile coordinate.
+    /// \returns the packed key.
+    PackedTileKey packedKeyForCoordinate(const TileCoordinate& coordinate) const;
+
+    /// \brief Forget an outstanding request once it completes.
+    /// \param key The key of the completed request.
+    void eraseOutstandingRequest(const TileKey& key);
+
     void cancelQueuedRequests() const;
 
+    /// \brief Determine if a coordinate's tile is in memory.
+    /// \param coordinate The tile coordinate.
+    /// \returns true if the tile is in memory.
     bool hasTile(const TileCoordinate& coordinate) const;
 
+    /// \brief Get a coordinate's tile if it is in memory.
+    /// \param coordinate The tile coordinate.
+    /// \returns the tile, or nullptr if it is not in memory.
     std::shared_ptr<Tile> getTile(const TileCoordinate& coordinate) const;
 
-    void requestTiles(const std::set<TileCoordinate>& coordinates) const;
-
-    virtual std::set<TileCoordinate> calculateVisibleCoordinates() const;
+    /// \brief Replace the pending tile requests with the given coordinates.
+    ///
+    /// Queued requests that are no longer needed are cancelled and the
+    /// remaining coordinates are ordered by distance from the current center.
+    ///
+    /// \param coordinates The coordinates of the missing visible tiles.
+    void requestTiles(const std::vector<TileCoordinate>& coordinates) const;
+
+    /// \brief Queue pending requests, nearest first, up to the maximum.
+    ///
+    /// Tiles that are backing off or loading elsewhere are skipped, and the
+    /// missing tiles are requested again after RETRY_INTERVAL.
+    void submitPendingRequests() const;
+
+    /// \brief Request the missing tiles again after RETRY_INTERVAL, unless a
+    /// retry is already scheduled.
+    void scheduleRetry() const;
+
+    /// \returns the range of tiles covering the padded viewport.
+    virtual TileRange calculateVisibleRange() const;
+
+    /// \brief Bring the visible and missing tiles up to date with the view.
+    ///
+    /// When the view pans at the same zoom, only tiles that left or entered
+    /// the visible range are updated. Otherwise the tiles are recalculated.
+    void updateVisibleCoordinates();
+
+    /// \brief Add a newly visible coordinate to the visible or missing tiles.
+    /// \param coord The tile coordinate.
+    void addVisibleCoordinate(const TileCoordinate& coord);
+
+    /// \brief Find loaded tiles to draw in place of the missing tiles.
+    ///
+    /// The nearest loaded ancestor is cropped to cover a missing tile. If
+    /// there is none, any of its four loaded children are drawn instead.
+    /// Only tiles already in memory are used, and none are requested.
+    void resolveFallbacks();
+
+    /// \brief Force the visible tiles to be recalculated on the next update.
+    void invalidateVisibleCoordinates();
 
     /// \brief The tile store to render.
     std::shared_ptr<MapTileSet> _tiles;
@@ -135,6 +236,9 @@ protected:
     /// \brief The current set id being viewed.
     std::string _setId;
 
+    /// \brief The interned index of _setId, used to build packed keys.
+    uint32_t _setIndex = 0;
+
     /// \brief The size of the tile layer.
     glm::vec2 _size;
 
@@ -149,9 +253,46 @@ protected:
     void onTileRequestCancelled(const TileKey& key);
     void onTileRequestFailed(const Cache::RequestFailedArgs<TileKey>& args);
 
-    /// \brief The current visible coordinates.
-    mutable std::set<TileCoordinate> _visisbleCoords;
-    mutable std::set<TileKey> _outstandingRequests;
+    /// \brief The range of tiles covered by the visible coordinates.
+    TileRange _visibleRange;
+
+    /// \brief The visible coordinates with a loaded tile, in drawing order.
+    std::vector<TileCoordinate> _visibleCoords;
+
+    /// \brief The visible coordinates waiting for a tile.
+    std::vector<TileCoordinate> _missingCoords;
+
+    /// \brief Visible coordinates found evicted while drawing.
+    mutable std::vector<TileCoordinate> _evictedCoords;
+
+    /// \brief A loaded tile drawn in place of a missing tile.
+    struct Fallback
+    {
+        /// \brief The coordinate of the missing tile.
+        TileCoordinate coordinate;
+
+        /// \brief The coordinate of the loaded ancestor or child.
+        TileCoordinate source;
+    };
+
+    /// \brief The substitutes for the missing tiles.
+    std::vector<Fallback> _fallbacks;
+
+    /// \brief True if the substitutes need to be found again.
+    mutable bool _fallbacksDirty = true;
+
+    /// \brief The keys of the queued or running tile requests.
+    mutable std::unordered_set<PackedTileKey> _outstandingRequests;
+
+    /// \brief Coordinates waiting to be requested, the nearest at the back.
+    mutable std::vector<TileCoordinate> _pendingCoordinates;
+
+    /// \brief The maximum number of tile requests queued at once.
+    std::size_t _maxOutstandingRequests = DEFAULT_MAX_OUTSTANDING_REQUESTS;
+
+    /// \brief The elapsed time in milliseconds at which the missing tiles are
+    /// requested again, or 0 if no retry is scheduled.
+    mutable uint64_t _retryTime = 0;
 
     std::unordered_map<TileCoordinate, std::shared_ptr<Tile>> _tilesToDraw;
 
@@ -8,12 +8,15 @@
 #pragma once
 
 
+#include <memory>
+#include <mutex>
 #include "Poco/RegularExpression.h"
 #include "ofJson.h"
 #include "ofx/Maps/AbstractMapTypes.h"
 #include "ofx/Maps/BaseProjection.h"
 #include "ofx/Maps/SphericalMercatorProjection.h"
 #include "ofx/Maps/TileCoordinate.h"
+#include "ofx/Maps/TileURITemplate.h"
 
 
 namespace ofx {
@@ -27,6 +30,20 @@ class TileKey;
 class MapTileProvider: public AbstractMapTileProvider
 {
 public:
+    /// \brief How a URI template is chosen when a provider has several.
+    enum class MirrorSelection
+    {
+        /// \brief Always send a tile to the same mirror.
+        ///
+        /// This keeps upstream HTTP caches and keep-alive connections warm.
+        CONSISTENT_HASH,
+        /// \brief Prefer mirrors with low latency and few errors.
+        ///
+        /// Each tile still maps to the same mirror while mirror health is
+        /// stable.
+        ADAPTIVE
+    };
+
     /// \brief Create a default MapTileProvider with no endpoint.
     MapTileProvider();
 
@@ -69,9 +86,65 @@ public:
     std::string getTileURI(const TileKey& coordinate) const override;
     bool isCacheable() const override;
 
+    /// \brief Render a tile's URI into a reusable string.
+    ///
+    /// This is the allocation-free form of getTileURI(), for bulk use such
+    /// as seeding a cache.
+    ///
+    /// \param key The tile key.
+    /// \param uri The string to render into. It is cleared first.
+    /// \returns the index of the mirror the URI was rendered from.
+    std::size_t renderTileURI(const TileKey& key, std::string& uri) const;
+
+    /// \brief Set how a URI template is chosen when there are several.
+    /// \param mirrorSelection The mirror selection strategy.
+    void setMirrorSelection(MirrorSelection mirrorSelection);
+
+    /// \returns how a URI template is chosen when there are several.
+    MirrorSelection getMirrorSelection() const;
+
+    /// \brief Choose the mirror used for a tile.
+    ///
+    /// This is safe to call from any thread.
+    ///
+    /// \param key The tile key.
+    /// \returns the index of the URI template to use.
+    std::size_t selectMirror(const TileKey& key) const;
+
+    /// \brief Report the outcome of a request to a mirror.
+    ///
+    /// Used by ADAPTIVE selection. This is safe to call from any thread.
+    ///
+    /// \param mirror The index of the mirror.
+    /// \param milliseconds The time taken by the request.
+    /// \param success False if the mirror failed or was overloaded.
+    void reportMirrorResult(std::size_t mirror,
+                            double milliseconds,
+                            bool success) const;
+
+    /// \returns a debug string with each mirror's health.
+    std::string mirrorsToString() const;
+
     /// \returns the URI templates.
     const std::vector<std::string> URITemplates() const;
 
+    /// \brief Set the values used for the {s} template parameter.
+    /// \param subdomains The subdomains.
+    void setSubdomains(const std::vector<std::string>& subdomains);
+
+    /// \returns the values used for the {s} template parameter.
+    std::vector<std::string> subdomains() const;
+
+    /// \brief Set the value used for the {r} template parameter, e.g. "@2x".
+    /// \param retinaSuffix The retina suffix.
+    void setRetinaSuffix(const std::string& retinaSuffix);
+
+    /// \returns the value used for the {r} template parameter.
+    std::string retinaSuffix() const;
+
+    /// \returns true if rows are numbered from the south, as in TMS.
+    bool isTMS() const;
+
     /// \returns a collection of name value-pairs used used by this provider.
     std::map<std::string, std::string> dictionary() const;
 
@@ -84,7 +157,9 @@ public:
         /// \brief The default tile width supported by most map tile providers.
         DEFAULT_TILE_WIDTH = 256,
         /// \brief The default tile height supported by most map tile providers.
-        DEFAULT_TILE_HEIGHT = 256
+        DEFAULT_TILE_HEIGHT = 256,
+        /// \brief The latency in milliseconds assumed for unmeasured mirrors.
+        DEFAULT_MIRROR_LATENCY = 100
     };
 
     /// \brief The default map bounds.
@@ -122,6 +197,12 @@ protected:
     /// This class should be overriden if the provider uses additional URI
     /// template variables.
     ///
+    /// Only parameters the compiled template doesn't know are passed here.
+    /// The built-in parameters {x}, {y}, {-y}, {z}, {quadkey}, {s}, {r},
+    /// {tile_id} and {set_id} are rendered by TileURITemplate::render() and
+    /// never reach this method, so overriding them here has no effect. Use a
+    /// custom parameter name to change how a value is rendered.
+    ///
     /// \param coordinate The tile coordinate requested.
     /// \param templateParameter The template parameter requested.
     /// \param templateValue The extracted value to be filled.
@@ -136,9 +217,50 @@ protected:
     /// \brief A collection of URI template parameters for each of the templates.
     std::vector<std::vector<std::string>> _URITemplateParameters;
 
+    /// \brief The compiled URI templates.
+    std::vector<TileURITemplate> _compiledURITemplates;
+
+    /// \brief The values used for the {s} template parameter.
+    std::vector<std::string> _subdomains;
+
+    /// \brief The value used for the {r} template parameter.
+    std::string _retinaSuffix;
+
+    /// \brief True if rows are numbered from the south, as in TMS.
+    bool _isTMS = false;
+
 private:
     void _setURITemplates(const std::vector<std::string>& templates);
 
+    /// \brief The measured health of a single mirror.
+    struct MirrorHealth
+    {
+        /// \brief The moving average latency in milliseconds, or 0 if unmeasured.
+        double latency = 0;
+
+        /// \brief The moving average error rate, from 0 to 1.
+        double errorRate = 0;
+
+        /// \brief The number of requests reported.
+        uint64_t numRequests = 0;
+
+        /// \brief The number of failed requests reported.
+        uint64_t numErrors = 0;
+    };
+
+    /// \brief The health of all mirrors, shared between loader threads.
+    struct MirrorHealthTable
+    {
+        std::vector<MirrorHealth> mirrors;
+        mutable std::mutex mutex;
+    };
+
+    /// \brief The mirror selection strategy, guarded by the health mutex.
+    MirrorSelection _mirrorSelection = MirrorSelection::CONSISTENT_HASH;
+
+    /// \brief The health of each mirror.
+    std::shared_ptr<MirrorHealthTable> _mirrorHealth;
+
     /// \brief A unique ID for the provider, based on the URI template.
     std::string _id;
 
@@ -8,16 +8,31 @@
 #pragma once
 
 
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <map>
+#include <random>
+#include <set>
+#include <unordered_map>
 #include "Poco/Task.h"
 #include "Poco/TaskNotification.h"
 #include "ofImage.h"
+#include "ofThreadChannel.h"
 #include "ofx/TaskQueue.h"
 #include "ofx/LRUCache.h"
 #include "ofx/Cache/BaseHTTPStore.h"
 #include "ofx/Cache/ResourceLoader.h"
 #include "ofx/Maps/AbstractMapTypes.h"
+#include "ofx/Maps/CompressedTileCache.h"
+#include "ofx/Maps/HostRateLimiter.h"
+#include "ofx/Maps/HTTPSessionPool.h"
 #include "ofx/Maps/TileCoordinate.h"
+#include "ofx/Maps/TileDecodePool.h"
+#include "ofx/Maps/TilePixelPool.h"
 #include "ofx/Maps/MapTileProvider.h"
+#include "ofx/Maps/PackedTileKey.h"
+#include "ofx/Maps/TileFreshness.h"
 #include "ofx/Maps/TileKey.h"
 #include "ofx/HTTP/ClientEvents.h"
 #include "ofx/HTTP/Client.h"
@@ -28,38 +43,433 @@ namespace ofx {
 namespace Maps {
 
 
+class MBTilesCache;
+
 
 class MapTileSet: public Cache::BaseResourceCache<TileKey, Tile>
 {
 public:
     typedef Cache::BaseCache<TileKey, ofBuffer> TileBufferCache;
 
+    /// \brief Create a MapTileSet.
+    ///
+    /// Tiles are fetched on the shared task queue's threads and decoded on a
+    /// separate, fixed-size decode pool, so each stage can be sized for its
+    /// own workload.
+    ///
+    /// \param cacheSize The number of decoded tiles to keep in memory.
+    /// \param provider The tile provider.
+    /// \param bufferCache The encoded tile cache, or nullptr for the default.
+    /// \param numDecodeThreads The number of decode threads, or 0 to use the
+    ///        hardware concurrency.
     MapTileSet(std::size_t cacheSize,
                std::shared_ptr<MapTileProvider> provider,
-               std::shared_ptr<TileBufferCache> bufferCache = nullptr);
+               std::shared_ptr<TileBufferCache> bufferCache = nullptr,
+               std::size_t numDecodeThreads = 0);
+
+    /// \brief Destroy the MapTileSet.
+    virtual ~MapTileSet();
 
     std::shared_ptr<Tile> load(Cache::CacheRequestTask<TileKey, Tile>& task) override;
     std::string toTaskId(const TileKey& key) const override;
 
     std::shared_ptr<MapTileProvider> provider() const;
 
+    /// \returns the keep-alive HTTP sessions shared by all tile loads.
+    HTTPSessionPool& sessionPool();
+
+    /// \returns the per-host rate and concurrency limits for tile fetches.
+    HostRateLimiter& rateLimiter();
+
+    /// \returns the pool of threads decoding fetched tiles.
+    TileDecodePool& decodePool();
+
+    /// \returns the pool of reusable pixel buffers shared by this set's tiles.
+    std::shared_ptr<TilePixelPool> pixelPool() const;
+
+    /// \brief Set where newly loaded tiles keep their image.
+    ///
+    /// With Tile::Residency::TEXTURE, a tile's pixels are released once its
+    /// texture is uploaded and decoded again from the buffer cache on demand.
+    /// Tiles that cannot be cached keep their pixels.
+    ///
+    /// \param residency The residency policy.
+    void setTileResidency(Tile::Residency residency);
+
+    /// \returns where newly loaded tiles keep their image.
+    Tile::Residency getTileResidency() const;
+
+    /// \returns the memory held by this set's tiles.
+    const TileMemoryStats& memoryStats() const;
+
+    /// \brief Set the memory budget for tiles held in memory.
+    ///
+    /// Pixels and textures count against the budget. The compressed tier is
+    /// bounded by its own budget, see compressedCache(). When a new tile
+    /// pushes usage over it, tiles not drawn in the current or previous frame
+    /// are evicted, largest and least recently drawn first. The entry count
+    /// given at construction still applies.
+    ///
+    /// \param maxBytes The maximum number of bytes, or 0 for no byte budget.
+    void setMaxBytes(uint64_t maxBytes);
+
+    /// \returns the memory budget in bytes, or 0 if there is none.
+    uint64_t getMaxBytes() const;
+
+    /// \returns the pixel and texture bytes currently held by this set's
+    ///          tiles.
+    uint64_t usedBytes() const;
+
+    /// \brief Get the in-memory tier of encoded tile bytes.
+    ///
+    /// Every tile loaded is also held here in encoded form, within its own
+    /// byte budget, so a tile evicted from the decoded tier is decoded again
+    /// without reading the disk cache.
+    ///
+    /// \returns the compressed tier.
+    CompressedTileCache& compressedCache();
+
+    /// \brief Read a group of tiles from the MBTiles cache in one batch.
+    ///
+    /// Call this just before requesting the tiles. The first load of any of
+    /// the keys reads them all with MBTilesCache::getMany() on one
+    /// connection, and the other loads take their bytes as soon as they
+    /// arrive instead of each reading the cache. Loads of keys the batch
+    /// did not find read the cache as usual.
+    ///
+    /// \param keys The tile keys about to be requested.
+    void batchCacheReads(const std::vector<TileKey>& keys);
+
+    /// \brief Determine if a tile is held in memory, by packed key.
+    ///
+    /// This is a cheap check for per-frame code like fallback resolution and
+    /// never builds a TileKey. Only call it from the main thread.
+    ///
+    /// \param key The packed tile key.
+    /// \returns true if the tile has been added and is still alive.
+    bool hasResident(const PackedTileKey& key) const;
+
+    /// \brief Get a tile held in memory, by packed key.
+    ///
+    /// The tile is taken from the cache with the key it was added under, so
+    /// it still counts as recently used. Only call it from the main thread.
+    ///
+    /// \param key The packed tile key.
+    /// \returns the tile, or nullptr if it is not in memory.
+    std::shared_ptr<Tile> getResident(const PackedTileKey& key);
+
+    /// \brief Determine if a tile is currently being loaded.
+    /// \param key The tile key.
+    /// \returns true if a load for the key is in flight.
+    bool isLoading(const TileKey& key) const;
+
+    /// \brief Determine if loads of a tile are being held back after a failure.
+    ///
+    /// Tiles that failed to load are retried with jittered exponential
+    /// backoff. Tiles the server reported missing are not retried until the
+    /// missing tile TTL has passed.
+    ///
+    /// \param key The tile key.
+    /// \returns true if the tile should not be requested yet.
+    bool isBackingOff(const TileKey& key) const;
+
+    /// \brief Set how long a tile the server reported missing is not retried.
+    ///
+    /// Missing tiles are also recorded in the MBTiles cache, if any, so they
+    /// are remembered across runs.
+    ///
+    /// \param seconds The time to live in seconds.
+    void setMissingTileTTL(uint64_t seconds);
+
+    /// \returns how long a missing tile is not retried in seconds.
+    uint64_t getMissingTileTTL() const;
+
+    /// \returns the number of tiles fetched from the provider's URI.
+    uint64_t numFetches() const;
+
+    /// \returns the number of tiles decoded.
+    uint64_t numDecodes() const;
+
+    /// \returns the number of loads that joined a load already in flight.
+    uint64_t numCoalesced() const;
+
+    /// \returns the number of loads skipped because the tile was resident.
+    uint64_t numResident() const;
+
+    /// \returns a summary of fetch, decode and deduplication counts and the
+    ///          decode queue depth.
+    std::string toString() const;
+
+    enum
+    {
+        /// \brief The default time to live of a missing tile in seconds.
+        DEFAULT_MISSING_TILE_TTL = 24 * 60 * 60,
+        /// \brief The backoff after a tile's first failure in milliseconds.
+        DEFAULT_RETRY_BACKOFF = 1000,
+        /// \brief The maximum backoff after repeated failures in milliseconds.
+        DEFAULT_MAX_RETRY_BACKOFF = 5 * 60 * 1000,
+        /// \brief The most failure records kept in memory. Expired records
+        /// are purged first, then those due to be retried soonest.
+        MAX_FAILURE_RECORDS = 4096,
+        /// \brief The most keys waiting for a batched cache read before
+        /// the waiting batches are abandoned.
+        MAX_BATCHED_READS = 1024
+    };
+
     static const std::string DEFAULT_BUFFER_CACHE_LOCATION;
 
 protected:
+    /// \brief The result of a fetch from the provider's URI.
+    enum class FetchStatus
+    {
+        /// \brief A new tile was received.
+        OK,
+        /// \brief The server responded 304 Not Modified.
+        NOT_MODIFIED,
+        /// \brief The server does not have the tile.
+        MISSING,
+        /// \brief The fetch failed and may succeed if retried.
+        FAILED
+    };
+
+    /// \brief Decode a tile directly from the MBTiles cache, if available.
+    ///
+    /// The decoder reads the SQLite blob directly, skipping the intermediate
+    /// ofBuffer copy made by _tryLoadFromCache(). If the cached tile has expired, it is still returned and a background
+    /// revalidation is queued.
+    ///
+    /// \param task The task requesting the tile.
+    /// \param pixels The pixels to fill.
+    /// \returns true if the tile was found and decoded.
+    bool _tryDecodeFromCache(Cache::CacheRequestTask<TileKey, Tile>& task,
+                             ofPixels& pixels);
+
     std::shared_ptr<ofBuffer> _tryLoadFromCache(Cache::CacheRequestTask<TileKey, Tile>& task);
-    std::shared_ptr<ofBuffer> _tryLoadFromURI(Cache::CacheRequestTask<TileKey, Tile>& task);
+
+    /// \brief Load a tile from the provider's URI.
+    /// \param task The task requesting the tile.
+    /// \param freshness Filled with the response's freshness information.
+    /// \param status Set to the result of the fetch.
+    /// \returns the encoded tile or nullptr on failure.
+    std::shared_ptr<ofBuffer> _tryLoadFromURI(Cache::CacheRequestTask<TileKey, Tile>& task,
+                                              TileFreshness& freshness,
+                                              FetchStatus& status);
 
     void _onAdd(const std::pair<TileKey, std::shared_ptr<Tile>>& args);
 
     std::shared_ptr<TileBufferCache> _bufferCache;
 
 private:
+    /// \brief A tile whose loads are held back after a failure.
+    struct FailureRecord
+    {
+        /// \brief The number of consecutive failures.
+        uint64_t numFailures = 0;
+
+        /// \brief The time before which the tile is not requested.
+        Poco::Timestamp retryAt;
+    };
+
+    /// \brief Hold back a tile after a failed load.
+    /// \param key The tile key.
+    /// \param isMissing True if the server does not have the tile.
+    /// \param expiresDate If not zero, the Unix time a missing tile was
+    ///        already recorded until in the MBTiles cache. It is used as is
+    ///        and not written again.
+    void _recordFailure(const TileKey& key,
+                        bool isMissing,
+                        int64_t expiresDate = 0);
+
+    /// \brief Forget a tile's failures after a successful load.
+    /// \param key The tile key.
+    void _clearFailure(const TileKey& key);
+
+    /// \brief Fetch a tile from the provider's URI.
+    /// \param key The tile key.
+    /// \param validators If not nullptr, used to make a conditional request.
+    /// \param freshness Filled with the response's freshness information.
+    /// \param status Set to the result of the fetch.
+    /// \param task If not nullptr, the task to receive progress updates.
+    /// \returns the encoded tile or nullptr if there is no new tile.
+    std::shared_ptr<ofBuffer> _fetch(const TileKey& key,
+                                     const TileFreshness* validators,
+                                     TileFreshness& freshness,
+                                     FetchStatus& status,
+                                     Cache::CacheRequestTask<TileKey, Tile>* task);
+
+    /// \brief Load a tile from the cache or the provider's URI.
+    ///
+    /// Only called by the first load in flight for a given key.
+    ///
+    /// \param task The task requesting the tile.
+    /// \returns the tile or nullptr on failure.
+    std::shared_ptr<Tile> _load(Cache::CacheRequestTask<TileKey, Tile>& task);
+
+    /// \brief Wrap decoded pixels in a tile configured for this set.
+    /// \param key The tile key.
+    /// \param pixels The decoded pixels to move into the tile.
+    /// \param unpersisted If not nullptr, the encoded bytes of a tile whose
+    ///        cache write may still be queued. The tile keeps them to decode
+    ///        released pixels until the cache can serve them.
+    /// \returns the tile.
+    std::shared_ptr<Tile> _makeTile(const TileKey& key,
+                                    ofPixels& pixels,
+                                    std::shared_ptr<ofBuffer> unpersisted = nullptr);
+
+    /// \brief Evict tiles until usage is within the memory budget.
+    ///
+    /// Must be called from the main thread, as evicted textures are freed.
+    void _enforceMaxBytes();
+
+    /// \brief Decode a tile into pooled pixels on the decode pool.
+    ///
+    /// If the pixels are not allocated, a buffer of the provider's tile size
+    /// is taken from the pixel pool first so that decoding can reuse it.
+    ///
+    /// \param data The encoded tile bytes.
+    /// \param size The number of encoded bytes.
+    /// \param pixels The pixels to fill.
+    /// \param isReserved True if a decode slot was already taken with
+    ///        TileDecodePool::reserve().
+    /// \returns true if the tile was decoded.
+    bool _decode(const char* data,
+                 std::size_t size,
+                 ofPixels& pixels,
+                 bool isReserved = false);
+
+    /// \brief A group of tiles read from the MBTiles cache together.
+    struct ReadBatch
+    {
+        /// \brief The keys to read.
+        std::vector<TileKey> keys;
+
+        /// \brief The tiles read so far, with a nullptr buffer if the tile
+        /// is not in the cache.
+        std::map<TileKey, std::pair<std::shared_ptr<ofBuffer>, TileFreshness>> results;
+
+        /// \brief True once a load has started reading the batch.
+        bool isStarted = false;
+
+        /// \brief True once every key has been read.
+        bool isFinished = false;
+
+        /// \brief The mutex protecting the batch.
+        std::mutex mutex;
+
+        /// \brief Signaled as tiles are read.
+        std::condition_variable condition;
+    };
+
+    /// \brief Take a tile's bytes from its read batch, reading the batch
+    /// first if no other load has.
+    /// \param key The tile key.
+    /// \param buffer Set to the tile's encoded bytes.
+    /// \param freshness Set to the tile's freshness.
+    /// \returns true if the tile was batched and found in the cache.
+    bool _takeFromReadBatch(const TileKey& key,
+                            std::shared_ptr<ofBuffer>& buffer,
+                            TileFreshness& freshness);
+
+    /// \brief Queue a stale tile for background revalidation.
+    /// \param key The tile key.
+    /// \param freshness The tile's stored freshness information.
+    void _queueRevalidation(const TileKey& key, const TileFreshness& freshness);
+
+    /// \brief Revalidate queued tiles until the channel is closed.
+    void _revalidate();
+
     /// \brief The tile provider associated with this loader.
     std::shared_ptr<MapTileProvider> _provider;
 
+    /// \brief The keep-alive HTTP sessions shared by all tile loads.
+    HTTPSessionPool _sessionPool;
+
+    /// \brief The per-host rate and concurrency limits for tile fetches.
+    HostRateLimiter _rateLimiter;
+
+    /// \brief The pool of threads decoding fetched tiles.
+    TileDecodePool _decodePool;
+
+    /// \brief The pool of reusable pixel buffers shared by this set's tiles.
+    std::shared_ptr<TilePixelPool> _pixelPool;
+
+    /// \brief Where newly loaded tiles keep their image.
+    std::atomic<Tile::Residency> _tileResidency;
+
+    /// \brief The memory held by this set's tiles.
+    std::shared_ptr<TileMemoryStats> _memoryStats;
+
+    /// \brief The in-memory tier of encoded tile bytes.
+    std::shared_ptr<CompressedTileCache> _compressedCache;
+
+    /// \brief The memory budget in bytes, or 0 for no byte budget.
+    std::atomic<uint64_t> _maxBytes;
+
+    /// \brief The tiles added while a byte budget is set, used to choose
+    /// eviction candidates. Only accessed from the main thread.
+    std::map<TileKey, std::weak_ptr<Tile>> _residentTiles;
+
+    /// \brief The key each added tile was cached under and the tile, by
+    /// packed key. Only accessed from the main thread.
+    std::unordered_map<PackedTileKey, std::pair<TileKey, std::weak_ptr<Tile>>> _packedTiles;
+
+    /// \brief The size at which expired entries are swept from _packedTiles.
+    std::size_t _packedTilesSweepSize = 256;
+
+    /// \brief The buffer cache, if it is an MBTilesCache supporting zero-copy reads.
+    std::shared_ptr<MBTilesCache> _mbtilesCache;
+
     /// \brief The onPut event listener used to load texture in the main thread.
     ofEventListener _onAddListener;
 
+    /// \brief The shared result of each load in flight, keyed by tile.
+    std::map<TileKey, std::shared_future<std::shared_ptr<Tile>>> _inFlight;
+
+    /// \brief The mutex protecting _inFlight.
+    mutable std::mutex _inFlightMutex;
+
+    /// \brief The read batch each requested key belongs to.
+    std::map<TileKey, std::shared_ptr<ReadBatch>> _readBatches;
+
+    /// \brief The mutex protecting _readBatches.
+    mutable std::mutex _readBatchesMutex;
+
+    /// \brief The tiles held back after a failure.
+    std::map<TileKey, FailureRecord> _failures;
+
+    /// \brief The source of backoff jitter.
+    std::minstd_rand _failureJitter;
+
+    /// \brief The mutex protecting _failures and _failureJitter.
+    mutable std::mutex _failuresMutex;
+
+    /// \brief How long a missing tile is not retried in seconds.
+    std::atomic<uint64_t> _missingTileTTL;
+
+    /// \brief The number of tiles fetched from the provider's URI.
+    std::atomic<uint64_t> _numFetches;
+
+    /// \brief The number of tiles decoded.
+    std::atomic<uint64_t> _numDecodes;
+
+    /// \brief The number of loads that joined a load already in flight.
+    std::atomic<uint64_t> _numCoalesced;
+
+    /// \brief The number of loads skipped because the tile was resident.
+    std::atomic<uint64_t> _numResident;
+
+    /// \brief The thread revalidating stale tiles.
+    std::thread _revalidateThread;
+
+    /// \brief Stale tiles waiting to be revalidated.
+    ofThreadChannel<std::pair<TileKey, TileFreshness>> _revalidateChannel;
+
+    /// \brief The tiles queued or being revalidated.
+    std::set<TileKey> _revalidating;
+
+    /// \brief The mutex protecting _revalidating.
+    std::mutex _revalidatingMutex;
+
 //    /// \brief The store mutex.
 //    mutable std::mutex _mutex;
 };
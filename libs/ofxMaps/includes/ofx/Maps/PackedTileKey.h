@@ -0,0 +1,175 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <cstdint>
+#include <string>
+#include "ofx/Maps/TileKey.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief A compact tile identifier for lookup-heavy code.
+///
+/// The zoom, column and row are packed into a single 64-bit code, with the
+/// zoom in the top bits and the column and row interleaved in Morton order
+/// below it. Set ids are interned, so a key is two integers and hashing and
+/// comparison never touch a string. Sorting by code groups keys by zoom and
+/// keeps nearby tiles close together.
+///
+/// Tile ids are not represented. Use canPack() to check that a TileKey
+/// converts without loss.
+class PackedTileKey
+{
+public:
+    /// \brief Create an empty PackedTileKey.
+    PackedTileKey();
+
+    /// \brief Create a PackedTileKey.
+    /// \param column The column to use.
+    /// \param row The row to use.
+    /// \param zoom The zoom level to use.
+    /// \param setId The set id to use.
+    PackedTileKey(int64_t column,
+                  int64_t row,
+                  int64_t zoom,
+                  const std::string& setId = TileKey::DEFAULT_SET_ID);
+
+    /// \brief Create a PackedTileKey from a TileKey.
+    /// \param key The key to pack.
+    explicit PackedTileKey(const TileKey& key);
+
+    /// \returns the column.
+    int64_t column() const;
+
+    /// \returns the row.
+    int64_t row() const;
+
+    /// \returns the zoom level.
+    int64_t zoom() const;
+
+    /// \returns the set id.
+    const std::string& setId() const;
+
+    /// \returns the packed zoom, column and row.
+    uint64_t code() const;
+
+    /// \returns the interned set id.
+    uint32_t setIndex() const;
+
+    /// \returns the equivalent TileKey.
+    TileKey toTileKey() const;
+
+    /// \returns a debug string representation.
+    std::string toString() const;
+
+    /// \returns a non-cryptographic hash.
+    std::size_t hash() const;
+
+    /// \brief This sorts tile keys by set, then by code.
+    bool operator < (const PackedTileKey& key) const;
+
+    /// \brief Determine if two tile keys are equal.
+    bool operator == (const PackedTileKey& key) const;
+
+    /// \brief Determine if two tile keys are not equal.
+    bool operator != (const PackedTileKey& key) const;
+
+    /// \brief Determine if a TileKey can be packed without loss.
+    ///
+    /// The zoom must be at most MAX_ZOOM, the column and row must be within
+    /// the zoom level and the tile id must be empty.
+    ///
+    /// \param key The key to check.
+    /// \returns true if the key can be packed.
+    static bool canPack(const TileKey& key);
+
+    /// \brief Create a PackedTileKey with an already interned set id.
+    ///
+    /// This skips the set id lookup, for callers building many keys in the
+    /// same set.
+    ///
+    /// \param column The column to use.
+    /// \param row The row to use.
+    /// \param zoom The zoom level to use.
+    /// \param setIndex The index returned by internSetId().
+    /// \returns the key.
+    static PackedTileKey fromSetIndex(int64_t column,
+                                      int64_t row,
+                                      int64_t zoom,
+                                      uint32_t setIndex);
+
+    /// \brief Get the interned index for a set id, adding it if needed.
+    /// \param setId The set id.
+    /// \returns the index, which is 0 for the default set id.
+    static uint32_t internSetId(const std::string& setId);
+
+    /// \brief Get the set id for an interned index.
+    /// \param setIndex The interned index.
+    /// \returns the set id, or the default set id if the index is unknown.
+    static const std::string& setIdForIndex(uint32_t setIndex);
+
+    enum
+    {
+        /// \brief The maximum zoom level that can be packed.
+        MAX_ZOOM = 29,
+        /// \brief The number of low bits holding the interleaved column and row.
+        ZOOM_SHIFT = 58
+    };
+
+private:
+    /// \brief The interned set ids shared by all keys.
+    struct SetIdTable;
+
+    /// \returns the interned set ids.
+    static SetIdTable& _setIdTable();
+
+    /// \brief Spread the low 32 bits of a value to the even bits.
+    static uint64_t _spreadBits(uint64_t value);
+
+    /// \brief Gather the even bits of a value into the low 32 bits.
+    static uint64_t _gatherBits(uint64_t value);
+
+    /// \returns the interleaved column and row.
+    uint64_t _morton() const;
+
+    /// \brief The zoom in the top bits, then the interleaved column and row.
+    uint64_t _code = 0;
+
+    /// \brief The interned set id.
+    uint32_t _setIndex = 0;
+
+};
+
+
+inline std::ostream& operator<<(std::ostream& os, const PackedTileKey& key)
+{
+    os << key.toString();
+    return os;
+}
+
+
+} } // namespace ofx::Maps
+
+
+namespace std {
+
+
+template <> struct hash<ofx::Maps::PackedTileKey>
+{
+    size_t operator()(const ofx::Maps::PackedTileKey& key) const
+    {
+        return key.hash();
+    }
+};
+
+
+} // namespace std
@@ -8,14 +8,43 @@
 #pragma once
 
 
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include "ofPixels.h"
 #include "ofTexture.h"
+#include "ofx/Maps/TilePixelPool.h"
 
 
 namespace ofx {
 namespace Maps {
 
 
+/// \brief Running totals of the memory held by a group of tiles.
+struct TileMemoryStats
+{
+    /// \brief The bytes held in CPU pixels.
+    std::atomic<int64_t> pixelBytes;
+
+    /// \brief The bytes held in GPU textures.
+    std::atomic<int64_t> textureBytes;
+
+    /// \brief The bytes held in compressed, encoded buffers.
+    std::atomic<int64_t> compressedBytes;
+
+    TileMemoryStats(): pixelBytes(0), textureBytes(0), compressedBytes(0)
+    {
+    }
+
+    /// \returns the total bytes held.
+    int64_t totalBytes() const
+    {
+        return pixelBytes + textureBytes + compressedBytes;
+    }
+};
+
+
 /// \brief A simple class representing an image tile.
 class Tile: public ofBaseDraws
 {
@@ -28,6 +57,22 @@ public:
         RASTER
     };
 
+    /// \brief Where a tile's image is kept once loaded.
+    enum class Residency
+    {
+        /// \brief Keep the CPU pixels. The texture is not uploaded until
+        /// the tile is first drawn.
+        PIXELS,
+        /// \brief Keep only the texture. Pixels are released after upload
+        /// and decoded again from the pixel source when needed.
+        TEXTURE,
+        /// \brief Keep both the CPU pixels and the texture.
+        BOTH
+    };
+
+    /// \brief A function that decodes the tile's pixels again.
+    typedef std::function<bool(ofPixels&)> PixelSource;
+
     /// \brief Create an empty un-allocated tile.
     Tile();
 
@@ -35,6 +80,12 @@ public:
     /// \param pixels The pixels to set.
     Tile(const ofPixels& pixels);
 
+    /// \brief Create a tile that takes ownership of the given pixels.
+    /// \param pixels The pixels to move into the tile.
+    /// \param pool If not nullptr, the pool the pixels are returned to when
+    ///        the tile is destroyed.
+    Tile(ofPixels&& pixels, std::shared_ptr<TilePixelPool> pool = nullptr);
+
     /// \brief Destroy the Tile.
     virtual ~Tile();
 
@@ -43,9 +94,30 @@ public:
     float getWidth() const override;
     float getHeight() const override;
 
+    /// \brief Draw part of the tile's texture.
+    ///
+    /// This is used to draw a crop of a lower zoom tile in place of a tile
+    /// that is still loading.
+    ///
+    /// \param x The x position to draw at.
+    /// \param y The y position to draw at.
+    /// \param width The width to draw.
+    /// \param height The height to draw.
+    /// \param sx The x position of the subsection in the tile's pixels.
+    /// \param sy The y position of the subsection in the tile's pixels.
+    /// \param sw The width of the subsection in the tile's pixels.
+    /// \param sh The height of the subsection in the tile's pixels.
+    void drawSubsection(float x, float y, float width, float height,
+                        float sx, float sy, float sw, float sh) const;
+
     /// \returns true if this is an empty un-allocated tile.
     bool empty() const;
 
+    /// \brief Get the pixels.
+    ///
+    /// If the pixels were released after a texture upload, they are decoded
+    /// again from the pixel source.
+    ///
     /// \returns a const reference to the pixels.
     const ofPixels& pixels() const;
 
@@ -58,21 +130,95 @@ public:
     /// \returns true if the texture is uploaded.
     bool hasTexture() const;
 
+    /// \returns true if the CPU pixels are currently held.
+    bool hasPixels() const;
+
     /// \brief Upload the pixels to a texture if needed.
+    ///
+    /// With Residency::TEXTURE, the pixels are released after the upload if
+    /// a pixel source is set. With Residency::PIXELS, nothing is uploaded and
+    /// the texture is uploaded by the first draw instead.
     void loadTexture();
 
     /// \brief Clear the texture memory, but retain the pixels.
     void clearTexture();
 
+    /// \brief Set where the tile's image is kept once loaded.
+    /// \param residency The residency policy.
+    void setResidency(Residency residency);
+
+    /// \returns the residency policy.
+    Residency residency() const;
+
+    /// \brief Set the function used to decode released pixels again.
+    /// \param source The pixel source.
+    void setPixelSource(PixelSource source);
+
+    /// \brief Set the totals this tile's memory is counted in.
+    /// \param stats The memory totals, or nullptr.
+    void setMemoryStats(std::shared_ptr<TileMemoryStats> stats);
+
+    /// \returns the bytes held in CPU pixels.
+    std::size_t pixelBytes() const;
+
+    /// \returns the bytes held in the GPU texture.
+    std::size_t textureBytes() const;
+
+    /// \returns the frame the tile was last loaded or drawn in.
+    uint64_t lastUsedFrame() const;
+
 private:
+    /// \brief Upload the pixels to the texture, decoding them again if they
+    /// were released.
+    void _uploadTexture() const;
+
+    /// \brief Release the CPU pixels, returning them to the pool.
+    void _releasePixels() const;
+
+    /// \brief Update the pixel and texture byte counts in the memory totals.
+    void _updateMemoryStats() const;
+
     /// \brief The Tile Type.
     Type _type = Type::EMPTY;
 
+    /// \brief The residency policy.
+    Residency _residency = Residency::BOTH;
+
+    /// \brief The tile width.
+    float _width = 0;
+
+    /// \brief The tile height.
+    float _height = 0;
+
+    /// \brief The frame the tile was last loaded or drawn in.
+    mutable std::atomic<uint64_t> _lastUsedFrame;
+
     /// \brief The pixels.
-    ofPixels _pixels;
+    mutable ofPixels _pixels;
 
     /// \brief The texture.
-    ofTexture _texture;
+    mutable ofTexture _texture;
+
+    /// \brief The bytes uploaded to the texture.
+    mutable std::size_t _textureBytes = 0;
+
+    /// \brief The pool the pixels are returned to, if any.
+    std::shared_ptr<TilePixelPool> _pixelPool;
+
+    /// \brief The function used to decode released pixels again.
+    PixelSource _pixelSource;
+
+    /// \brief The memory totals this tile is counted in, if any.
+    std::shared_ptr<TileMemoryStats> _memoryStats;
+
+    /// \brief The pixel bytes currently counted in the memory totals.
+    mutable std::size_t _countedPixelBytes = 0;
+
+    /// \brief The texture bytes currently counted in the memory totals.
+    mutable std::size_t _countedTextureBytes = 0;
+
+    /// \brief The mutex protecting the pixels.
+    mutable std::recursive_mutex _mutex;
 
 };
 
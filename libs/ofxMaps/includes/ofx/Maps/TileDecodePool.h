@@ -0,0 +1,135 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ofPixels.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief A fixed-size pool of threads that decode encoded tiles.
+///
+/// Tile loads are mostly I/O bound and run on many task threads. Decoding is
+/// CPU bound, so it is handed to this pool to keep the number of concurrent
+/// decodes near the number of cores. The queue between the two stages is
+/// bounded. Callers block while it is full, so callers holding a scarce
+/// resource, such as a database connection, should reserve() a slot before
+/// taking it.
+class TileDecodePool
+{
+public:
+    /// \brief Create a TileDecodePool.
+    /// \param numThreads The number of decode threads, or 0 to use the
+    ///        hardware concurrency.
+    /// \param maxQueueSize The maximum number of decodes waiting for a thread.
+    TileDecodePool(std::size_t numThreads = 0,
+                   std::size_t maxQueueSize = DEFAULT_MAX_QUEUE_SIZE);
+
+    /// \brief Destroy the TileDecodePool, waiting for queued decodes.
+    ~TileDecodePool();
+
+    /// \brief Decode an encoded tile on a decode thread.
+    ///
+    /// Blocks while the queue is full, then until the decode is complete, so the data only needs to remain
+    /// valid for the duration of the call.
+    ///
+    /// \param data The encoded tile bytes.
+    /// \param size The number of encoded bytes.
+    /// \param pixels The pixels to fill.
+    /// \returns true if the tile was decoded.
+    bool decode(const char* data, std::size_t size, ofPixels& pixels);
+
+    /// \brief Wait for room in the queue and hold it for one decode.
+    ///
+    /// Every call must be matched by a call to decodeReserved() or
+    /// cancelReservation().
+    void reserve();
+
+    /// \brief Decode an encoded tile in a slot taken with reserve().
+    ///
+    /// This never waits for room in the queue, only for the decode.
+    ///
+    /// \param data The encoded tile bytes.
+    /// \param size The number of encoded bytes.
+    /// \param pixels The pixels to fill.
+    /// \returns true if the tile was decoded.
+    bool decodeReserved(const char* data, std::size_t size, ofPixels& pixels);
+
+    /// \brief Give back a slot taken with reserve() without decoding.
+    void cancelReservation();
+
+    /// \returns the number of decode threads.
+    std::size_t numThreads() const;
+
+    /// \brief Set the maximum number of decodes waiting for a thread.
+    /// \param maxQueueSize The maximum queue size.
+    void setMaxQueueSize(std::size_t maxQueueSize);
+
+    /// \returns the maximum number of decodes waiting for a thread.
+    std::size_t getMaxQueueSize() const;
+
+    /// \returns the number of decodes waiting for a thread.
+    std::size_t queueDepth() const;
+
+    /// \returns the largest queue depth seen.
+    std::size_t maxQueueDepth() const;
+
+    /// \returns a debug string.
+    std::string toString() const;
+
+    enum
+    {
+        /// \brief The default maximum number of decodes waiting for a thread.
+        DEFAULT_MAX_QUEUE_SIZE = 64
+    };
+
+private:
+    /// \brief Run queued decodes until the pool is destroyed.
+    void _run();
+
+    /// \brief The decode threads.
+    std::vector<std::thread> _threads;
+
+    /// \brief The decodes waiting for a thread.
+    std::deque<std::packaged_task<bool()>> _queue;
+
+    /// \brief The maximum number of decodes waiting for a thread.
+    std::size_t _maxQueueSize = DEFAULT_MAX_QUEUE_SIZE;
+
+    /// \brief The largest queue depth seen.
+    std::size_t _maxQueueDepth = 0;
+
+    /// \brief The slots held by reserve() and not yet used.
+    std::size_t _numReserved = 0;
+
+    /// \brief True while the pool is accepting decodes.
+    bool _isRunning = true;
+
+    /// \brief Signaled when a decode is queued or the pool stops.
+    std::condition_variable _notEmpty;
+
+    /// \brief Signaled when room is made in the queue or the pool stops.
+    std::condition_variable _notFull;
+
+    /// \brief The mutex protecting the queue.
+    mutable std::mutex _mutex;
+
+};
+
+
+} } // namespace ofx::Maps
@@ -0,0 +1,157 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ofPixels.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief The encoded formats a tile may be stored in.
+enum class TileFormat
+{
+    /// \brief The format could not be determined.
+    UNKNOWN,
+    /// \brief A PNG image.
+    PNG,
+    /// \brief A JPEG image.
+    JPEG,
+    /// \brief A WebP image.
+    WEBP,
+    /// \brief A GIF image.
+    GIF
+};
+
+
+/// \brief An abstract class representing a tile image decoder backend.
+class AbstractTileDecoder
+{
+public:
+    /// \brief Destroy the AbstractTileDecoder.
+    virtual ~AbstractTileDecoder()
+    {
+    }
+
+    /// \returns the name of this decoder.
+    virtual std::string name() const = 0;
+
+    /// \brief Determine if this decoder can decode the given format.
+    /// \param format The sniffed format.
+    /// \returns true if this decoder supports the format.
+    virtual bool canDecode(TileFormat format) const = 0;
+
+    /// \brief Decode an encoded image directly from memory.
+    ///
+    /// The data is only read during the call, so it may point into memory
+    /// owned by someone else, such as a SQLite blob. If the pixels are
+    /// already allocated with the decoded size and channels, their memory
+    /// is reused.
+    ///
+    /// Decoders are shared between threads and must be thread-safe.
+    ///
+    /// \param data A pointer to the encoded image bytes.
+    /// \param size The number of encoded bytes.
+    /// \param pixels The pixels to fill.
+    /// \returns true if the image was decoded successfully.
+    virtual bool decode(const char* data,
+                        std::size_t size,
+                        ofPixels& pixels) const = 0;
+
+};
+
+
+/// \brief Decodes any format FreeImage supports.
+class FreeImageTileDecoder: public AbstractTileDecoder
+{
+public:
+    std::string name() const override;
+    bool canDecode(TileFormat format) const override;
+    bool decode(const char* data,
+                std::size_t size,
+                ofPixels& pixels) const override;
+
+};
+
+
+/// \brief Decodes encoded tile images into pixels.
+///
+/// The format is sniffed from the leading magic bytes and the most recently
+/// registered decoder supporting it is used. A FreeImageTileDecoder is always
+/// available as the fallback for every format.
+class TileDecoder
+{
+public:
+    /// \brief Decode an encoded image directly from memory.
+    ///
+    /// Unlike ofLoadImage(), this does not require the encoded bytes to be
+    /// copied into an ofBuffer first. The data is only read during the call,
+    /// so it may point into memory owned by someone else, such as a SQLite
+    /// blob.
+    ///
+    /// \param data A pointer to the encoded image bytes.
+    /// \param size The number of encoded bytes.
+    /// \param pixels The pixels to fill.
+    /// \returns true if the image was decoded successfully.
+    static bool decode(const char* data, std::size_t size, ofPixels& pixels);
+
+    /// \brief Determine the format of an encoded image from its magic bytes.
+    /// \param data A pointer to the encoded image bytes.
+    /// \param size The number of encoded bytes.
+    /// \returns the format or TileFormat::UNKNOWN.
+    static TileFormat sniff(const char* data, std::size_t size);
+
+    /// \brief Estimate the number of channels an encoded image decodes to.
+    ///
+    /// PNG images are inspected for their IHDR color type and any tRNS
+    /// chunk, JPEG images decode to RGB and everything else is assumed to be
+    /// RGBA. The estimate lets pooled pixels be acquired with the right shape
+    /// so the decoder doesn't have to reallocate them.
+    ///
+    /// \param data A pointer to the encoded image bytes.
+    /// \param size The number of encoded bytes.
+    /// \returns the expected number of channels.
+    static std::size_t sniffChannels(const char* data, std::size_t size);
+
+    /// \brief Register a decoder backend.
+    ///
+    /// Decoders registered later are preferred over those registered earlier.
+    ///
+    /// \param decoder The decoder to register.
+    static void registerDecoder(std::shared_ptr<AbstractTileDecoder> decoder);
+
+    /// \brief Remove all registered decoders except the FreeImage fallback.
+    static void resetDecoders();
+
+    /// \brief Get the decoder that will be used for a format.
+    /// \param format The format to decode.
+    /// \returns the decoder or nullptr if no decoder supports the format.
+    static std::shared_ptr<AbstractTileDecoder> decoderFor(TileFormat format);
+
+private:
+    typedef std::vector<std::shared_ptr<AbstractTileDecoder>> Decoders;
+
+    /// \returns the current decoders, most preferred first.
+    static std::shared_ptr<const Decoders> _decoders();
+
+    /// \returns the mutex protecting the registered decoders.
+    static std::mutex& _mutex();
+
+    /// \returns the registered decoders.
+    static std::shared_ptr<const Decoders>& _registered();
+
+};
+
+
+} } // namespace ofx::Maps
@@ -0,0 +1,75 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <string>
+#include "Poco/Net/HTTPResponse.h"
+#include "Poco/Timestamp.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief HTTP freshness and validation information for a cached tile.
+///
+/// Dates are stored as seconds since the Unix epoch. A date of zero is
+/// unknown.
+struct TileFreshness
+{
+    /// \brief The time the tile was cached or last revalidated.
+    int64_t cachedDate = 0;
+
+    /// \brief The time after which the tile should be revalidated.
+    ///
+    /// Zero means the tile never expires.
+    int64_t expiresDate = 0;
+
+    /// \brief The ETag used for If-None-Match revalidation.
+    std::string eTag;
+
+    /// \brief The Last-Modified value used for If-Modified-Since revalidation.
+    std::string lastModified;
+
+    /// \brief Determine if the tile has expired.
+    /// \param now The current time.
+    /// \returns true if the tile has an expiry date that has passed.
+    bool isStale(const Poco::Timestamp& now = Poco::Timestamp()) const;
+
+    /// \returns true if the tile can be revalidated with a conditional request.
+    bool hasValidators() const;
+
+    /// \brief Extract freshness information from a response.
+    ///
+    /// Cache-Control max-age, no-cache and no-store take precedence over
+    /// Expires. Responses without either never expire.
+    ///
+    /// \param response The response to read.
+    /// \param now The time the response was received.
+    /// \returns the freshness information.
+    static TileFreshness fromResponse(const Poco::Net::HTTPResponse& response,
+                                      const Poco::Timestamp& now = Poco::Timestamp());
+
+    /// \brief Extract freshness information from a 304 Not Modified response.
+    ///
+    /// If the response doesn't give a new lifetime, the tile keeps the
+    /// lifetime it was previously cached with, counted from now.
+    ///
+    /// \param response The response to read.
+    /// \param previous The tile's stored freshness information.
+    /// \param now The time the response was received.
+    /// \returns the freshness information.
+    static TileFreshness fromNotModified(const Poco::Net::HTTPResponse& response,
+                                         const TileFreshness& previous,
+                                         const Poco::Timestamp& now = Poco::Timestamp());
+
+};
+
+
+} } // namespace ofx::Maps
@@ -54,10 +54,10 @@ public:
 //    std::string providerId() const;
 
     /// \returns the set id.
-    std::string setId() const;
+    const std::string& setId() const;
 
     /// \returns the tile id.
-    std::string tileId() const;
+    const std::string& tileId() const;
 
     /// \returns a debug string representation.
     std::string toString() const;
@@ -65,6 +65,31 @@ public:
     /// \returns a non-cryptographic hash.
     std::size_t hash() const;
 
+    /// \returns the tile's position along the Hilbert curve at its zoom.
+    /// \sa hilbertIndex(int64_t, int64_t, int64_t)
+    uint64_t hilbertIndex() const;
+
+    /// \brief Get a tile's position along the Hilbert curve at its zoom.
+    ///
+    /// Tiles that are close on the map are usually close on the curve, so
+    /// sorting by this index keeps neighbouring tiles together. Zoom levels
+    /// above 31 are not supported and return 0.
+    ///
+    /// \param column The tile column.
+    /// \param row The tile row.
+    /// \param zoom The tile zoom level.
+    /// \returns the Hilbert index.
+    static uint64_t hilbertIndex(int64_t column, int64_t row, int64_t zoom);
+
+    /// \brief Sorts tile keys by set, zoom, then position on the Hilbert curve.
+    ///
+    /// Use this in place of operator< where spatially adjacent tiles should
+    /// sort together, e.g. std::set<TileKey, TileKey::HilbertOrder>.
+    struct HilbertOrder
+    {
+        bool operator () (const TileKey& key0, const TileKey& key1) const;
+    };
+
     /// \brief Stream output.
     /// \param os the std::ostream.
     /// \param coordinate The TileKey to output.
@@ -74,8 +99,17 @@ public:
 
 
     /// \brief This sorts tile keys.
+    ///
+    /// The integer coordinates are compared before the ids, so most
+    /// comparisons never touch the strings.
     bool operator < (const TileKey& coordinate) const;
 
+    /// \brief Determine if two tile keys are equal.
+    bool operator == (const TileKey& key) const;
+
+    /// \brief Determine if two tile keys are not equal.
+    bool operator != (const TileKey& key) const;
+
     /// \brief The default set id (default is empty).
     static const std::string DEFAULT_SET_ID;
 
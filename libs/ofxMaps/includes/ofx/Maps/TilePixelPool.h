@@ -0,0 +1,95 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "ofPixels.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief A pool of reusable tile-sized pixel buffers.
+///
+/// Square 256 and 512 pixel RGB and RGBA buffers are kept when released and
+/// handed out again instead of allocating new ones. This keeps the largest
+/// allocations on the tile load path off the heap once the pool is warm.
+/// Other shapes are allocated and freed normally.
+class TilePixelPool
+{
+public:
+    /// \brief Create a TilePixelPool.
+    /// \param maxBuffersPerShape The maximum number of idle buffers kept for
+    ///        each size and channel count.
+    TilePixelPool(std::size_t maxBuffersPerShape = DEFAULT_MAX_BUFFERS_PER_SHAPE);
+
+    /// \brief Get pixels allocated with the given shape.
+    /// \param width The width in pixels.
+    /// \param height The height in pixels.
+    /// \param channels The number of channels.
+    /// \returns pooled pixels if available, otherwise newly allocated pixels.
+    ofPixels acquire(std::size_t width, std::size_t height, std::size_t channels);
+
+    /// \brief Return pixels to the pool.
+    ///
+    /// The pixels are freed if their shape is not pooled or the pool for
+    /// their shape is full.
+    ///
+    /// \param pixels The pixels to return.
+    void release(ofPixels&& pixels);
+
+    /// \brief Free all idle buffers.
+    void clear();
+
+    /// \returns the number of idle buffers.
+    std::size_t size() const;
+
+    /// \returns a debug string.
+    std::string toString() const;
+
+    /// \brief Determine if buffers of the given shape are pooled.
+    /// \param width The width in pixels.
+    /// \param height The height in pixels.
+    /// \param channels The number of channels.
+    /// \returns true if the shape is pooled.
+    static bool isPooled(std::size_t width, std::size_t height, std::size_t channels);
+
+    enum
+    {
+        /// \brief The default maximum number of idle buffers per shape.
+        DEFAULT_MAX_BUFFERS_PER_SHAPE = 64
+    };
+
+private:
+    typedef std::tuple<std::size_t, std::size_t, std::size_t> Shape;
+
+    /// \brief The maximum number of idle buffers per shape.
+    std::size_t _maxBuffersPerShape = DEFAULT_MAX_BUFFERS_PER_SHAPE;
+
+    /// \brief The idle buffers, by shape.
+    std::map<Shape, std::vector<ofPixels>> _buffers;
+
+    /// \brief The number of buffers handed out from the pool.
+    uint64_t _numReused = 0;
+
+    /// \brief The number of buffers allocated because the pool was empty.
+    uint64_t _numAllocated = 0;
+
+    /// \brief The mutex protecting the pool.
+    mutable std::mutex _mutex;
+
+};
+
+
+} } // namespace ofx::Maps
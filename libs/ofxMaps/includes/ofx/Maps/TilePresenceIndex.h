@@ -0,0 +1,104 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include "ofx/Maps/TileKey.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief A compact, thread-safe index of which tiles are stored.
+///
+/// The index is a Bloom filter keyed on (zoom, column, row, set id). A
+/// negative answer is always correct, so it can be used to skip database
+/// lookups for tiles that were never stored. A positive answer may be a
+/// false positive and must be confirmed.
+///
+/// Tiles can be added concurrently with lookups, but never removed. Tiles
+/// that are removed from the store remain positive until the index is
+/// cleared and rebuilt.
+class TilePresenceIndex
+{
+public:
+    /// \brief Create a TilePresenceIndex.
+    /// \param capacity The expected number of tiles.
+    TilePresenceIndex(std::size_t capacity = DEFAULT_CAPACITY);
+
+    /// \brief Destroy the TilePresenceIndex.
+    ~TilePresenceIndex();
+
+    /// \brief Add a tile to the index.
+    /// \param zoom The tile zoom level.
+    /// \param column The tile column.
+    /// \param row The tile row.
+    /// \param setId The tile set id, or an empty string.
+    void add(int64_t zoom,
+             int64_t column,
+             int64_t row,
+             const std::string& setId);
+
+    /// \brief Add a tile to the index.
+    /// \param key The tile key to add.
+    void add(const TileKey& key);
+
+    /// \brief Check if a tile might be stored.
+    ///
+    /// A key with an empty set id matches a tile stored with any set id.
+    ///
+    /// \param key The tile key to check.
+    /// \returns false if the tile is definitely not stored.
+    bool mayContain(const TileKey& key) const;
+
+    /// \brief Remove all tiles from the index.
+    void clear();
+
+    /// \returns the number of bits in the filter.
+    std::size_t numBits() const;
+
+    enum
+    {
+        /// \brief The default expected number of tiles.
+        DEFAULT_CAPACITY = 1 << 20,
+        /// \brief The number of bits per expected tile (~1% false positives).
+        BITS_PER_TILE = 10,
+        /// \brief The number of hash functions used.
+        NUM_HASHES = 7
+    };
+
+private:
+    /// \brief Set the bits for a single hash.
+    void _add(uint64_t hash);
+
+    /// \brief Test the bits for a single hash.
+    bool _test(uint64_t hash) const;
+
+    /// \brief Hash a tile location and set id.
+    static uint64_t _hash(int64_t zoom,
+                          int64_t column,
+                          int64_t row,
+                          const std::string& setId);
+
+    /// \brief The number of 64 bit words in the filter.
+    std::size_t _numWords = 0;
+
+    /// \brief The mask used to map a bit index into the filter.
+    uint64_t _bitMask = 0;
+
+    /// \brief The filter bits.
+    std::unique_ptr<std::atomic<uint64_t>[]> _words;
+
+};
+
+
+} } // namespace ofx::Maps
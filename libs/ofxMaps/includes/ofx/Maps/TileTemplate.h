@@ -54,6 +54,9 @@ public:
     static const std::string TEMPLATE_PARAM_ZOOM;
     static const std::string TEMPLATE_PARAM_X;
     static const std::string TEMPLATE_PARAM_Y;
+    static const std::string TEMPLATE_PARAM_TMS_Y;
+    static const std::string TEMPLATE_PARAM_SUBDOMAIN;
+    static const std::string TEMPLATE_PARAM_RETINA;
     static const std::string TEMPLATE_PARAM_TILE_ID;
     static const std::string TEMPLATE_PARAM_SET_ID;
 
@@ -0,0 +1,116 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#pragma once
+
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "ofx/Maps/TileKey.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief A URI template compiled into literal and parameter segments.
+///
+/// The template is parsed once. Rendering appends each segment to a
+/// caller-provided string, so no searching, regular expressions or temporary
+/// strings are needed per URI.
+///
+/// Supported parameters are {x}, {y}, {-y} (TMS row), {z}, {quadkey}, {s}
+/// (subdomain), {r} (retina suffix), {tile_id} and {set_id}. Any other
+/// parameter is passed to a resolver when rendering.
+class TileURITemplate
+{
+public:
+    /// \brief A function resolving an unknown parameter, e.g. "{key}".
+    typedef std::function<bool(const std::string& parameter, std::string& value)> Resolver;
+
+    /// \brief Create an empty TileURITemplate.
+    TileURITemplate();
+
+    /// \brief Compile a TileURITemplate.
+    /// \param URITemplate The URI template to compile.
+    TileURITemplate(const std::string& URITemplate);
+
+    /// \brief Render the URI for a tile.
+    /// \param key The tile key.
+    /// \param subdomain The value for {s}.
+    /// \param retinaSuffix The value for {r}.
+    /// \param flipY True if {y} should be rendered as a TMS row.
+    /// \param resolver Resolves unknown parameters, may be empty.
+    /// \param uri The string to render into. It is cleared first.
+    void render(const TileKey& key,
+                const std::string& subdomain,
+                const std::string& retinaSuffix,
+                bool flipY,
+                const Resolver& resolver,
+                std::string& uri) const;
+
+    /// \returns the source template.
+    const std::string& source() const;
+
+    /// \returns true if the template uses the {s} parameter.
+    bool hasSubdomain() const;
+
+private:
+    /// \brief The kinds of segment in a compiled template.
+    enum class SegmentType
+    {
+        LITERAL,
+        X,
+        Y,
+        TMS_Y,
+        ZOOM,
+        QUADKEY,
+        SUBDOMAIN,
+        RETINA,
+        TILE_ID,
+        SET_ID,
+        CUSTOM
+    };
+
+    /// \brief A literal run or a parameter.
+    struct Segment
+    {
+        /// \brief The segment type.
+        SegmentType type;
+
+        /// \brief The literal text, or the full parameter for CUSTOM.
+        std::string text;
+    };
+
+    /// \brief Append an integer in decimal.
+    /// \param value The value to append.
+    /// \param uri The string to append to.
+    static void _appendNumber(int64_t value, std::string& uri);
+
+    /// \brief Flip a tile's row to the TMS scheme, counting up from the south.
+    /// \param key The tile key.
+    /// \returns the flipped row, or the row unchanged if the zoom is out of
+    ///          range.
+    static int64_t _tmsRow(const TileKey& key);
+
+    /// \brief The source template.
+    std::string _source;
+
+    /// \brief The compiled segments.
+    std::vector<Segment> _segments;
+
+    /// \brief The length of all literal segments, used to reserve space.
+    std::size_t _literalLength = 0;
+
+    /// \brief True if the template uses the {s} parameter.
+    bool _hasSubdomain = false;
+
+};
+
+
+} } // namespace ofx::Maps
@@ -0,0 +1,220 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/CompressedTileCache.h"
+#include <iterator>
+#include <sstream>
+
+
+namespace ofx {
+namespace Maps {
+
+
+CompressedTileCache::CompressedTileCache(uint64_t maxBytes):
+    _maxBytes(maxBytes)
+{
+}
+
+
+CompressedTileCache::~CompressedTileCache()
+{
+    clear();
+}
+
+
+std::shared_ptr<ofBuffer> CompressedTileCache::get(const TileKey& key,
+                                                   TileFreshness* freshness)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    auto iter = _index.find(key);
+
+    if (iter == _index.end())
+    {
+        ++_numMisses;
+        return nullptr;
+    }
+
+    ++_numHits;
+
+    // Move the entry to the front without invalidating iterators.
+    _entries.splice(_entries.begin(), _entries, iter->second);
+
+    if (freshness != nullptr)
+    {
+        *freshness = iter->second->freshness;
+    }
+
+    return iter->second->buffer;
+}
+
+
+void CompressedTileCache::add(const TileKey& key,
+                              std::shared_ptr<ofBuffer> buffer,
+                              const TileFreshness& freshness)
+{
+    if (buffer == nullptr)
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // Don't hold anything that could never fit.
+    if (buffer->size() > _maxBytes)
+    {
+        return;
+    }
+
+    auto iter = _index.find(key);
+
+    if (iter != _index.end())
+    {
+        _erase(iter->second);
+    }
+
+    _entries.push_front(Entry{ key, buffer, freshness });
+    _index[key] = _entries.begin();
+    _usedBytes += buffer->size();
+
+    if (_memoryStats != nullptr)
+    {
+        _memoryStats->compressedBytes += buffer->size();
+    }
+
+    _evict();
+}
+
+
+void CompressedTileCache::remove(const TileKey& key)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    auto iter = _index.find(key);
+
+    if (iter != _index.end())
+    {
+        _erase(iter->second);
+    }
+}
+
+
+void CompressedTileCache::clear()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (_memoryStats != nullptr)
+    {
+        _memoryStats->compressedBytes -= _usedBytes;
+    }
+
+    _entries.clear();
+    _index.clear();
+    _usedBytes = 0;
+}
+
+
+void CompressedTileCache::setMaxBytes(uint64_t maxBytes)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _maxBytes = maxBytes;
+    _evict();
+}
+
+
+uint64_t CompressedTileCache::getMaxBytes() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _maxBytes;
+}
+
+
+uint64_t CompressedTileCache::usedBytes() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _usedBytes;
+}
+
+
+std::size_t CompressedTileCache::size() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _index.size();
+}
+
+
+uint64_t CompressedTileCache::numHits() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _numHits;
+}
+
+
+uint64_t CompressedTileCache::numMisses() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _numMisses;
+}
+
+
+void CompressedTileCache::setMemoryStats(std::shared_ptr<TileMemoryStats> stats)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (_memoryStats != nullptr)
+    {
+        _memoryStats->compressedBytes -= _usedBytes;
+    }
+
+    _memoryStats = stats;
+
+    if (_memoryStats != nullptr)
+    {
+        _memoryStats->compressedBytes += _usedBytes;
+    }
+}
+
+
+std::string CompressedTileCache::toString() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    std::stringstream ss;
+    ss << "Compressed Tiles: " << _index.size();
+    ss << " Bytes: " << _usedBytes << "/" << _maxBytes;
+    ss << " Hits: " << _numHits;
+    ss << " Misses: " << _numMisses;
+    return ss.str();
+}
+
+
+void CompressedTileCache::_erase(std::list<Entry>::iterator iter)
+{
+    std::size_t size = iter->buffer->size();
+
+    _usedBytes -= size;
+
+    if (_memoryStats != nullptr)
+    {
+        _memoryStats->compressedBytes -= size;
+    }
+
+    _index.erase(iter->key);
+    _entries.erase(iter);
+}
+
+
+void CompressedTileCache::_evict()
+{
+    while (_usedBytes > _maxBytes && !_entries.empty())
+    {
+        _erase(std::prev(_entries.end()));
+    }
+}
+
+
+} } // namespace ofx::Maps
@@ -0,0 +1,99 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/HTTPBodyReader.h"
+#include <algorithm>
+
+
+namespace ofx {
+namespace Maps {
+
+
+std::shared_ptr<ofBuffer> HTTPBodyReader::read(const Poco::Net::HTTPResponse& response,
+                                               std::istream& stream,
+                                               std::size_t maxSize)
+{
+    auto buffer = std::make_shared<ofBuffer>();
+
+    int64_t contentLength = response.getContentLength64();
+
+    if (contentLength > int64_t(maxSize))
+    {
+        return nullptr;
+    }
+    else if (contentLength >= 0)
+    {
+        // Allocate once and read straight into the buffer.
+        buffer->resize(std::size_t(contentLength));
+
+        if (contentLength > 0)
+        {
+            stream.read(buffer->getData(), std::streamsize(contentLength));
+
+            if (stream.gcount() != std::streamsize(contentLength))
+            {
+                return nullptr;
+            }
+        }
+
+        return buffer;
+    }
+
+    // Chunked or unknown length, so grow geometrically until the stream ends.
+    std::size_t size = 0;
+
+    while (stream.good())
+    {
+        if (size == buffer->size())
+        {
+            if (size >= maxSize)
+            {
+                return nullptr;
+            }
+
+            buffer->resize(std::min(std::max(size * 2, size + DEFAULT_CHUNK_SIZE), maxSize));
+        }
+
+        stream.read(buffer->getData() + size, std::streamsize(buffer->size() - size));
+        size += std::size_t(stream.gcount());
+    }
+
+    if (stream.bad())
+    {
+        return nullptr;
+    }
+
+    buffer->resize(size);
+    return buffer;
+}
+
+
+bool HTTPBodyReader::discard(std::istream& stream,
+                             std::string* prefix,
+                             std::size_t maxSize)
+{
+    char chunk[4096];
+    std::size_t total = 0;
+
+    while (stream.good() && total < maxSize)
+    {
+        stream.read(chunk, std::streamsize(std::min(sizeof(chunk), maxSize - total)));
+        std::size_t count = std::size_t(stream.gcount());
+
+        if (prefix != nullptr && prefix->size() < MAX_PREFIX_SIZE)
+        {
+            prefix->append(chunk, std::min(count, MAX_PREFIX_SIZE - prefix->size()));
+        }
+
+        total += count;
+    }
+
+    return stream.eof() && !stream.bad();
+}
+
+
+} } // namespace ofx::Maps
@@ -0,0 +1,149 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/HTTPSessionPool.h"
+#include <algorithm>
+#include <sstream>
+
+
+namespace ofx {
+namespace Maps {
+
+
+HTTPSessionPool::Session::Session(const std::string& hostKey):
+    _hostKey(hostKey)
+{
+}
+
+
+const std::string& HTTPSessionPool::Session::hostKey() const
+{
+    return _hostKey;
+}
+
+
+HTTPSessionPool::HTTPSessionPool(std::size_t maxSessionsPerHost):
+    _maxSessionsPerHost(std::max(maxSessionsPerHost, std::size_t(1)))
+{
+}
+
+
+HTTPSessionPool::~HTTPSessionPool()
+{
+}
+
+
+std::unique_ptr<HTTPSessionPool::Session> HTTPSessionPool::borrowSession(const Poco::URI& uri)
+{
+    std::string key = hostKey(uri);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    Host& host = _hosts[key];
+
+    while (true)
+    {
+        if (!host.idle.empty())
+        {
+            std::unique_ptr<Session> session = std::move(host.idle.back());
+            host.idle.pop_back();
+            ++host.numBorrowed;
+            ++_numReused;
+            return session;
+        }
+        else if (host.numBorrowed < _maxSessionsPerHost)
+        {
+            ++host.numBorrowed;
+            ++_numCreated;
+            return std::make_unique<Session>(key);
+        }
+
+        _condition.wait(lock);
+    }
+}
+
+
+void HTTPSessionPool::returnSession(std::unique_ptr<Session> session, bool reusable)
+{
+    if (session == nullptr)
+    {
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        Host& host = _hosts[session->hostKey()];
+
+        if (host.numBorrowed > 0)
+        {
+            --host.numBorrowed;
+        }
+
+        // Drop sessions beyond the limit in case it was lowered.
+        if (reusable && host.numBorrowed + host.idle.size() < _maxSessionsPerHost)
+        {
+            host.idle.push_back(std::move(session));
+        }
+    }
+
+    _condition.notify_all();
+}
+
+
+void HTTPSessionPool::setMaxSessionsPerHost(std::size_t maxSessionsPerHost)
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _maxSessionsPerHost = std::max(maxSessionsPerHost, std::size_t(1));
+    }
+
+    _condition.notify_all();
+}
+
+
+std::size_t HTTPSessionPool::getMaxSessionsPerHost() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _maxSessionsPerHost;
+}
+
+
+void HTTPSessionPool::clear()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    for (auto& host: _hosts)
+    {
+        host.second.idle.clear();
+    }
+}
+
+
+std::string HTTPSessionPool::toString() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    std::stringstream ss;
+    ss << "Created: " << _numCreated << " Reused: " << _numReused;
+
+    for (const auto& host: _hosts)
+    {
+        ss << " " << host.first << " (" << host.second.numBorrowed << "/" << host.second.idle.size() << ")";
+    }
+
+    return ss.str();
+}
+
+
+std::string HTTPSessionPool::hostKey(const Poco::URI& uri)
+{
+    return uri.getScheme() + "://" + uri.getHost() + ":" + std::to_string(uri.getPort());
+}
+
+
+} } // namespace ofx::Maps
@@ -0,0 +1,281 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/HostRateLimiter.h"
+#include <algorithm>
+#include <sstream>
+#include "Poco/DateTimeParser.h"
+#include "Poco/NumberParser.h"
+#include "Poco/Timestamp.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+HostRateLimiter::HostRateLimiter(double requestsPerSecond,
+                                 std::size_t maxInFlight):
+    _requestsPerSecond(std::max(requestsPerSecond, 0.0)),
+    _maxInFlight(std::max(maxInFlight, std::size_t(1)))
+{
+}
+
+
+void HostRateLimiter::acquire(const std::string& hostKey)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true)
+    {
+        auto now = Clock::now();
+
+        Host& host = _host(hostKey, now);
+
+        // Refill the bucket, allowing a burst of up to one second of requests.
+        if (_requestsPerSecond > 0)
+        {
+            double elapsed = std::chrono::duration<double>(now - host.lastRefill).count();
+            host.tokens = std::min(host.tokens + elapsed * _requestsPerSecond,
+                                   std::max(_requestsPerSecond, 1.0));
+        }
+
+        host.lastRefill = now;
+
+        Clock::time_point wakeTime = Clock::time_point::max();
+
+        if (now < host.blockedUntil)
+        {
+            wakeTime = host.blockedUntil;
+        }
+        else if (host.inFlight >= static_cast<std::size_t>(host.limit))
+        {
+            // Wait for a request to finish.
+        }
+        else if (_requestsPerSecond > 0 && host.tokens < 1)
+        {
+            auto wait = std::chrono::duration<double>((1 - host.tokens) / _requestsPerSecond);
+            wakeTime = now + std::chrono::duration_cast<Clock::duration>(wait);
+        }
+        else
+        {
+            if (_requestsPerSecond > 0)
+            {
+                host.tokens -= 1;
+            }
+
+            ++host.inFlight;
+            return;
+        }
+
+        if (wakeTime == Clock::time_point::max())
+        {
+            _condition.wait(lock);
+        }
+        else
+        {
+            _condition.wait_until(lock, wakeTime);
+        }
+    }
+}
+
+
+void HostRateLimiter::release(const std::string& hostKey,
+                              Outcome outcome,
+                              double milliseconds,
+                              double retryAfterSeconds,
+                              bool isLatencySample)
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        auto now = Clock::now();
+
+        Host& host = _host(hostKey, now);
+
+        if (host.inFlight > 0)
+        {
+            --host.inFlight;
+        }
+
+        double maxLimit = static_cast<double>(_maxInFlight);
+
+        if (outcome == Outcome::SUCCESS)
+        {
+            bool isCongested = false;
+
+            if (isLatencySample)
+            {
+                // Queueing at the host shows up as latency well above normal.
+                isCongested = host.baselineLatency > 0
+                           && milliseconds > 4 * host.baselineLatency;
+
+                if (host.baselineLatency > 0)
+                {
+                    host.baselineLatency += (milliseconds - host.baselineLatency) / LATENCY_BASELINE_WINDOW;
+                }
+                else
+                {
+                    host.baselineLatency = milliseconds;
+                }
+            }
+
+            if (isCongested)
+            {
+                host.limit = std::max(1.0, host.limit * 0.9);
+            }
+            else
+            {
+                // Grow by about one per window of successful requests.
+                host.limit = std::min(maxLimit, host.limit + 1.0 / std::max(host.limit, 1.0));
+            }
+        }
+        else
+        {
+            host.limit = std::max(1.0, host.limit / 2);
+
+            if (outcome == Outcome::THROTTLED)
+            {
+                ++host.numThrottled;
+
+                double backoff = retryAfterSeconds > 0 ? retryAfterSeconds
+                                                       : static_cast<double>(DEFAULT_THROTTLE_BACKOFF);
+
+                auto blockedUntil = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(backoff));
+                host.blockedUntil = std::max(host.blockedUntil, blockedUntil);
+            }
+        }
+    }
+
+    _condition.notify_all();
+}
+
+
+void HostRateLimiter::setRequestsPerSecond(double requestsPerSecond)
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _requestsPerSecond = std::max(requestsPerSecond, 0.0);
+    }
+
+    _condition.notify_all();
+}
+
+
+double HostRateLimiter::getRequestsPerSecond() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _requestsPerSecond;
+}
+
+
+void HostRateLimiter::setMaxInFlight(std::size_t maxInFlight)
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _maxInFlight = std::max(maxInFlight, std::size_t(1));
+
+        for (auto& host: _hosts)
+        {
+            host.second.limit = std::min(host.second.limit, static_cast<double>(_maxInFlight));
+        }
+    }
+
+    _condition.notify_all();
+}
+
+
+std::size_t HostRateLimiter::getMaxInFlight() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _maxInFlight;
+}
+
+
+std::string HostRateLimiter::toString() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    std::stringstream ss;
+
+    for (const auto& host: _hosts)
+    {
+        ss << host.first << " (";
+        ss << host.second.inFlight << "/" << static_cast<std::size_t>(host.second.limit);
+        ss << ", throttled " << host.second.numThrottled << ") ";
+    }
+
+    return ss.str();
+}
+
+
+HostRateLimiter::Outcome HostRateLimiter::outcomeFor(const Poco::Net::HTTPResponse& response)
+{
+    auto status = response.getStatus();
+
+    if (status == Poco::Net::HTTPResponse::HTTP_TOO_MANY_REQUESTS
+     || status == Poco::Net::HTTPResponse::HTTP_SERVICE_UNAVAILABLE)
+    {
+        return Outcome::THROTTLED;
+    }
+    else if (status >= Poco::Net::HTTPResponse::HTTP_INTERNAL_SERVER_ERROR)
+    {
+        return Outcome::FAILED;
+    }
+
+    return Outcome::SUCCESS;
+}
+
+
+double HostRateLimiter::retryAfterSeconds(const Poco::Net::HTTPResponse& response)
+{
+    if (!response.has("Retry-After"))
+    {
+        return 0;
+    }
+
+    const std::string& value = response.get("Retry-After");
+
+    int seconds = 0;
+
+    if (Poco::NumberParser::tryParse(value, seconds))
+    {
+        return std::max(seconds, 0);
+    }
+
+    Poco::DateTime date;
+    int timeZoneDifferential = 0;
+
+    if (Poco::DateTimeParser::tryParse(value, date, timeZoneDifferential))
+    {
+        date.makeUTC(timeZoneDifferential);
+        double delay = (date.timestamp() - Poco::Timestamp()) / 1000000.0;
+        return std::max(delay, 0.0);
+    }
+
+    return 0;
+}
+
+
+HostRateLimiter::Host& HostRateLimiter::_host(const std::string& hostKey,
+                                              Clock::time_point now)
+{
+    auto iter = _hosts.find(hostKey);
+
+    if (iter == _hosts.end())
+    {
+        Host host;
+        host.tokens = std::max(_requestsPerSecond, 1.0);
+        host.lastRefill = now;
+        host.limit = std::min(static_cast<double>(_maxInFlight), 2.0);
+        iter = _hosts.insert(std::make_pair(hostKey, host)).first;
+    }
+
+    return iter->second;
+}
+
+
+} } // namespace ofx::Maps
@@ -6,8 +6,11 @@
 
 
 #include "ofx/Maps/MBTilesCache.h"
+#include <algorithm>
+#include <set>
 #include "Poco/SHA1Engine.h"
 #include "ofImage.h"
+#include "ofx/Maps/TileDecoder.h"
 #include "ofUtils.h"
 
 
@@ -132,27 +135,70 @@ const std::string MBTilesConnection::DROP_TABLE_METADATA = "DROP TABLE IF EXISTS
 const std::string MBTilesConnection::QUERY_TILES = "SELECT tile_data FROM `tiles` WHERE zoom_level = :zoom_level AND tile_column = :tile_column AND tile_row = :tile_row";
 const std::string MBTilesConnection::QUERY_TILES_WITH_SET_ID = QUERY_TILES + " AND set_id = :set_id";
 
+// The tiles view predates the freshness columns, so join the tables directly.
+const std::string MBTilesConnection::QUERY_TILES_WITH_FRESHNESS = "SELECT images.tile_data AS tile_data, map.tile_cached_date AS tile_cached_date, map.tile_expires_date AS tile_expires_date, map.tile_etag AS tile_etag, map.tile_last_modified AS tile_last_modified FROM `map` JOIN `images` ON images.tile_id = map.tile_id WHERE map.zoom_level = :zoom_level AND map.tile_column = :tile_column AND map.tile_row = :tile_row";
+const std::string MBTilesConnection::QUERY_TILES_WITH_FRESHNESS_WITH_SET_ID = QUERY_TILES_WITH_FRESHNESS + " AND map.set_id = :set_id";
+
+const std::string MBTilesConnection::QUERY_TILE_HILBERT_RANGE = "SELECT map.tile_hilbert AS tile_hilbert, images.tile_data AS tile_data, map.tile_cached_date AS tile_cached_date, map.tile_expires_date AS tile_expires_date, map.tile_etag AS tile_etag, map.tile_last_modified AS tile_last_modified FROM `map` JOIN `images` ON images.tile_id = map.tile_id WHERE map.zoom_level = :zoom_level AND map.tile_hilbert BETWEEN :min_tile_hilbert AND :max_tile_hilbert ORDER BY map.tile_hilbert";
+const std::string MBTilesConnection::QUERY_TILE_HILBERT_RANGE_WITH_SET_ID = "SELECT map.tile_hilbert AS tile_hilbert, images.tile_data AS tile_data, map.tile_cached_date AS tile_cached_date, map.tile_expires_date AS tile_expires_date, map.tile_etag AS tile_etag, map.tile_last_modified AS tile_last_modified FROM `map` JOIN `images` ON images.tile_id = map.tile_id WHERE map.zoom_level = :zoom_level AND map.tile_hilbert BETWEEN :min_tile_hilbert AND :max_tile_hilbert AND map.set_id = :set_id ORDER BY map.tile_hilbert";
+
 const std::string MBTilesConnection::COUNT_TILES = "SELECT COUNT(tile_data) FROM `tiles` WHERE zoom_level = :zoom_level AND tile_column = :tile_column AND tile_row = :tile_row";
 const std::string MBTilesConnection::COUNT_TILES_WITH_SET_ID = COUNT_TILES + " AND set_id = :set_id";
 
-//const std::string MBTilesConnection::INSERT_IMAGE = "INSERT OR IGNORE INTO `images` (`tile_id`, `tile_data`) VALUES (:tile_id, :tile_data)";
-const std::string MBTilesConnection::INSERT_IMAGE = "INSERT INTO `images` (`tile_id`, `tile_data`) VALUES (:tile_id, :tile_data)";
+const std::string MBTilesConnection::INSERT_IMAGE = "INSERT OR IGNORE INTO `images` (`tile_id`, `tile_data`) VALUES (:tile_id, :tile_data)";
 
 const std::string MBTilesConnection::COUNT_IMAGE = "SELECT COUNT(tile_id) FROM `images` WHERE tile_id = :tile_id";
 
-const std::string MBTilesConnection::INSERT_MAP = "INSERT INTO `map` (`zoom_level`, `tile_column`, `tile_row`, `tile_id`) VALUES (:zoom_level, :tile_column, :tile_row, :tile_id)";
-const std::string MBTilesConnection::INSERT_MAP_WITH_SET_ID = "INSERT INTO `map` (`zoom_level`, `tile_column`, `tile_row`, `tile_id`, `set_id`) VALUES (:zoom_level, :tile_column, :tile_row, :tile_id, :set_id)";
+// NULL set_ids are distinct in the map_index, so rows without a set_id can't
+// rely on INSERT OR IGNORE and are guarded with NOT EXISTS instead.
+const std::string MBTilesConnection::INSERT_MAP = "INSERT INTO `map` (`zoom_level`, `tile_column`, `tile_row`, `tile_hilbert`, `tile_id`, `tile_accessed_date`, `tile_cached_date`, `tile_expires_date`, `tile_etag`, `tile_last_modified`) SELECT :zoom_level, :tile_column, :tile_row, :tile_hilbert, :tile_id, CAST(strftime('%s', 'now') AS INTEGER), :tile_cached_date, :tile_expires_date, :tile_etag, :tile_last_modified WHERE NOT EXISTS (SELECT 1 FROM `map` WHERE zoom_level = :zoom_level AND tile_column = :tile_column AND tile_row = :tile_row AND set_id IS NULL)";
+const std::string MBTilesConnection::INSERT_MAP_WITH_SET_ID = "INSERT OR IGNORE INTO `map` (`zoom_level`, `tile_column`, `tile_row`, `tile_hilbert`, `tile_id`, `set_id`, `tile_accessed_date`, `tile_cached_date`, `tile_expires_date`, `tile_etag`, `tile_last_modified`) VALUES (:zoom_level, :tile_column, :tile_row, :tile_hilbert, :tile_id, :set_id, CAST(strftime('%s', 'now') AS INTEGER), :tile_cached_date, :tile_expires_date, :tile_etag, :tile_last_modified)";
 
 const std::string MBTilesConnection::COUNT_MAP = "SELECT COUNT(tile_id) FROM `map` WHERE zoom_level = :zoom_level AND tile_column = :tile_column AND tile_row = :tile_row";
 const std::string MBTilesConnection::COUNT_MAP_WITH_SET_ID = COUNT_MAP +  " AND set_id = :set_id";
 
 const std::string MBTilesConnection::COUNT_ALL = "SELECT COUNT(*) FROM `tiles`";
 
+const std::string MBTilesConnection::QUERY_MAP_KEYS = "SELECT zoom_level, tile_column, tile_row, set_id FROM `map`";
+const std::string MBTilesConnection::COUNT_MAP_KEYS = "SELECT COUNT(*) FROM `map`";
+
+const std::string MBTilesConnection::TOUCH_MAP = "UPDATE `map` SET tile_accessed_date = CAST(strftime('%s', 'now') AS INTEGER) WHERE zoom_level = :zoom_level AND tile_column = :tile_column AND tile_row = :tile_row";
+const std::string MBTilesConnection::TOUCH_MAP_WITH_SET_ID = TOUCH_MAP + " AND set_id = :set_id";
+
+// Keep the previous validators if the 304 response didn't repeat them.
+const std::string MBTilesConnection::REFRESH_MAP = "UPDATE `map` SET tile_cached_date = :tile_cached_date, tile_expires_date = :tile_expires_date, tile_etag = COALESCE(NULLIF(:tile_etag, ''), tile_etag), tile_last_modified = COALESCE(NULLIF(:tile_last_modified, ''), tile_last_modified) WHERE zoom_level = :zoom_level AND tile_column = :tile_column AND tile_row = :tile_row";
+const std::string MBTilesConnection::REFRESH_MAP_WITH_SET_ID = REFRESH_MAP + " AND set_id = :set_id";
+
+const std::string MBTilesConnection::QUERY_MAP_ROWS = "SELECT rowid, tile_id FROM `map` WHERE zoom_level = :zoom_level AND tile_column = :tile_column AND tile_row = :tile_row";
+const std::string MBTilesConnection::QUERY_MAP_ROWS_WITH_SET_ID = QUERY_MAP_ROWS + " AND set_id = :set_id";
+const std::string MBTilesConnection::QUERY_MAP_ROWS_WITHOUT_HILBERT = "SELECT rowid, zoom_level, tile_column, tile_row FROM `map` WHERE tile_hilbert IS NULL";
+const std::string MBTilesConnection::UPDATE_MAP_HILBERT = "UPDATE `map` SET tile_hilbert = :tile_hilbert WHERE rowid = :rowid";
+const std::string MBTilesConnection::QUERY_LEAST_RECENTLY_USED_MAP_ROWS = "SELECT rowid, tile_id FROM `map` ORDER BY tile_accessed_date ASC LIMIT :limit";
+
+const std::string MBTilesConnection::DELETE_MAP_ROW = "DELETE FROM `map` WHERE rowid = :rowid";
+const std::string MBTilesConnection::DELETE_UNUSED_IMAGE = "DELETE FROM `images` WHERE tile_id = :tile_id AND NOT EXISTS (SELECT 1 FROM `map` WHERE tile_id = :tile_id)";
+const std::string MBTilesConnection::DELETE_ALL_MAP = "DELETE FROM `map`";
+const std::string MBTilesConnection::DELETE_ALL_IMAGES = "DELETE FROM `images`";
+
+// Missing tiles store an empty set_id rather than NULL so the unique index
+// applies and INSERT OR REPLACE can be used for every key.
+const std::string MBTilesConnection::INSERT_MISSING = "INSERT OR REPLACE INTO `missing` (`zoom_level`, `tile_column`, `tile_row`, `set_id`, `expires_date`) VALUES (:zoom_level, :tile_column, :tile_row, :set_id, :expires_date)";
+const std::string MBTilesConnection::QUERY_MISSING = "SELECT expires_date FROM `missing` WHERE zoom_level = :zoom_level AND tile_column = :tile_column AND tile_row = :tile_row AND set_id = :set_id";
+const std::string MBTilesConnection::DELETE_MISSING = "DELETE FROM `missing` WHERE zoom_level = :zoom_level AND tile_column = :tile_column AND tile_row = :tile_row AND set_id = :set_id";
+const std::string MBTilesConnection::DELETE_EXPIRED_MISSING = "DELETE FROM `missing` WHERE expires_date <= :now";
+const std::string MBTilesConnection::DELETE_ALL_MISSING = "DELETE FROM `missing`";
+
 
 
 //"-- via https://github.com/mapbox/node-mbtiles/blob/master/lib/schema.sql"
 // Several additions to assist with caching.
-// images table - added tile_expires_date and tile_cached_date
+// map table - added tile_accessed_date for least recently used eviction.
+// map table - added tile_cached_date, tile_expires_date, tile_etag and
+// tile_last_modified for HTTP revalidation. These are stored per tile rather
+// than per image because identical images are shared between tiles.
+// map table - added tile_hilbert, the tile's position on the Hilbert curve at
+// its zoom, so spatially adjacent tiles can be read with one index range.
+// missing table - added to remember tiles the server does not have.
 // tiles -
 // images.tile_data AS tile_data,"
 // images.tile_expires_date AS tile_expires_date,"
@@ -163,9 +209,15 @@ const std::string MBTilesConnection::MBTILES_SCHEMA =
 "   zoom_level INTEGER,"
 "   tile_column INTEGER,"
 "   tile_row INTEGER,"
+"   tile_hilbert INTEGER,"
 "   tile_id TEXT,"
 "   set_id TEXT,"
-"   grid_id TEXT"
+"   grid_id TEXT,"
+"   tile_accessed_date INTEGER DEFAULT 0,"
+"   tile_cached_date INTEGER DEFAULT 0,"
+"   tile_expires_date INTEGER DEFAULT 0,"
+"   tile_etag TEXT,"
+"   tile_last_modified TEXT"
 ");"
 ""
 "CREATE TABLE IF NOT EXISTS grid_key ("
@@ -199,6 +251,14 @@ const std::string MBTilesConnection::MBTILES_SCHEMA =
 "    data BLOB"
 ");"
 ""
+"CREATE TABLE IF NOT EXISTS missing ("
+"    zoom_level INTEGER,"
+"    tile_column INTEGER,"
+"    tile_row INTEGER,"
+"    set_id TEXT NOT NULL DEFAULT '',"
+"    expires_date INTEGER DEFAULT 0"
+");"
+""
 "CREATE UNIQUE INDEX IF NOT EXISTS map_index ON map (zoom_level, tile_column, tile_row, set_id);"
 "CREATE UNIQUE INDEX IF NOT EXISTS grid_key_lookup ON grid_key (grid_id, key_name);"
 "CREATE UNIQUE INDEX IF NOT EXISTS keymap_lookup ON keymap (key_name);"
@@ -206,8 +266,12 @@ const std::string MBTilesConnection::MBTILES_SCHEMA =
 "CREATE UNIQUE INDEX IF NOT EXISTS images_id ON images (tile_id);"
 "CREATE UNIQUE INDEX IF NOT EXISTS name ON metadata (name);"
 "CREATE INDEX IF NOT EXISTS map_grid_id ON map (grid_id);"
+"CREATE INDEX IF NOT EXISTS map_tile_id ON map (tile_id);"
+"CREATE INDEX IF NOT EXISTS map_accessed_date ON map (tile_accessed_date);"
+"CREATE INDEX IF NOT EXISTS map_hilbert ON map (zoom_level, tile_hilbert);"
 "CREATE INDEX IF NOT EXISTS geocoder_type_index ON geocoder_data (type);"
 "CREATE UNIQUE INDEX IF NOT EXISTS geocoder_shard_index ON geocoder_data (type, shard);"
+"CREATE UNIQUE INDEX IF NOT EXISTS missing_index ON missing (zoom_level, tile_column, tile_row, set_id);"
 ""
 "CREATE VIEW IF NOT EXISTS tiles AS"
 "    SELECT"
@@ -414,6 +478,14 @@ MBTilesMetadata MBTilesConnection::getMetaData() const noexcept
 
 bool MBTilesConnection::setTile(const TileKey& key,
                                 const ofBuffer& image) noexcept
+{
+    return upsertTile(key, image) != UpsertResult::FAILED;
+}
+
+
+MBTilesConnection::UpsertResult MBTilesConnection::upsertTile(const TileKey& key,
+                                                              const ofBuffer& image,
+                                                              const TileFreshness& freshness) noexcept
 {
     if (_mode != Mode::READ_ONLY)
     {
@@ -429,85 +501,104 @@ bool MBTilesConnection::setTile(const TileKey& key,
 
         try
         {
-            SQLite::Statement& countImage = getStatement(COUNT_IMAGE);
-            countImage.bind(":tile_id", tileId);
-            int result = countImage.executeStep();
-            auto column = countImage.getColumn(0);
+            // Identical images share a row, so an ignored insert is expected.
+            SQLite::Statement& insertImage = getStatement(INSERT_IMAGE);
+            insertImage.bind(":tile_id", tileId);
+            insertImage.bind(":tile_data", image.getData(), image.size());
+            insertImage.exec();
+        }
+        catch (const std::exception& e)
+        {
+            ofLogError("MBTilesConnection::upsertTile()") << "INSERTING TILE SQLite exception: " << e.what() << " " << index() << " " << useCount();
+            return UpsertResult::FAILED;
+        }
+
+        try
+        {
+            SQLite::Statement& insertMap = getStatement(key.setId().empty() ? INSERT_MAP : INSERT_MAP_WITH_SET_ID);
+            insertMap.bind(":tile_column", key.column());
+            insertMap.bind(":tile_row", key.row());
+            insertMap.bind(":zoom_level", key.zoom());
+            insertMap.bind(":tile_hilbert", static_cast<int64_t>(key.hilbertIndex()));
+            insertMap.bind(":tile_id", tileId);
+            insertMap.bind(":tile_cached_date", freshness.cachedDate != 0 ? freshness.cachedDate : static_cast<int64_t>(Poco::Timestamp().epochTime()));
+            insertMap.bind(":tile_expires_date", freshness.expiresDate);
+            insertMap.bind(":tile_etag", freshness.eTag);
+            insertMap.bind(":tile_last_modified", freshness.lastModified);
 
-            if (column.getInt64() == 0)
+            if (!key.setId().empty())
             {
-                SQLite::Statement& insertImage = getStatement(INSERT_IMAGE);
-                insertImage.bind(":tile_id", tileId);
-                insertImage.bind(":tile_data", image.getData(), image.size());
-
-                if (insertImage.exec() != 1)
-                {
-                    ofLogError("MBTilesConnection::setTile()") << "Unable to insert image.";
-                    return false;
-                }
+                insertMap.bind(":set_id", key.setId());
             }
+
+            return insertMap.exec() == 1 ? UpsertResult::INSERTED : UpsertResult::EXISTS;
         }
         catch (const std::exception& e)
         {
-            ofLogError("MBTilesConnection::setTile()") << "INSERTING TILE SQLite exception: " << e.what() << " " << index() << " " << useCount();
-            return false;
+            ofLogError("MBTilesConnection::upsertTile()") << "INSERTING MAP SQLite exception: " << e.what() << " " << index() << " " << useCount();
+            return UpsertResult::FAILED;
         }
+    }
+    else
+    {
+        ofLogError("MBTilesConnection::upsertTile()") << "No setting data on a read-only database.";
+        return UpsertResult::FAILED;
+    }
+}
+
+
+std::size_t MBTilesConnection::setTiles(const std::vector<TileEntry>& tiles) noexcept
+{
+    if (_mode != Mode::READ_ONLY)
+    {
+        std::size_t numWritten = 0;
 
         try
         {
-            SQLite::Statement& selectMap = getStatement(key.setId().empty() ? COUNT_MAP : COUNT_MAP_WITH_SET_ID);
-            selectMap.bind(":tile_column", key.column());
-            selectMap.bind(":tile_row", key.row());
-            selectMap.bind(":zoom_level", key.zoom());
+            // Insert in Hilbert order so neighbouring tiles share pages.
+            std::vector<const TileEntry*> sortedTiles;
+            sortedTiles.reserve(tiles.size());
 
-            if (!key.setId().empty())
+            for (const auto& tile: tiles)
             {
-                selectMap.bind(":set_id", key.setId());
+                sortedTiles.push_back(&tile);
             }
 
-            int result = selectMap.executeStep();
-            auto column = selectMap.getColumn(0);
+            TileKey::HilbertOrder order;
 
-            if (column.getInt64() == 0)
-            {
-                SQLite::Statement& insertMap = getStatement(key.setId().empty() ? INSERT_MAP : INSERT_MAP_WITH_SET_ID);
-                insertMap.bind(":tile_column", key.column());
-                insertMap.bind(":tile_row", key.row());
-                insertMap.bind(":zoom_level", key.zoom());
-                insertMap.bind(":tile_id", tileId);
+            std::sort(sortedTiles.begin(),
+                      sortedTiles.end(),
+                      [&order](const TileEntry* tile0, const TileEntry* tile1)
+                      {
+                          return order(tile0->first, tile1->first);
+                      });
 
-                if (!key.setId().empty())
-                {
-                    insertMap.bind(":set_id", key.setId());
-                }
+            SQLite::Transaction transaction(_database);
 
-                if (insertMap.exec() == 1)
-                {
-                    return true;
-                }
-                else
+            for (const auto* tile: sortedTiles)
+            {
+                if (tile->second != nullptr
+                &&  upsertTile(tile->first, *tile->second) == UpsertResult::INSERTED)
                 {
-                    ofLogError("MBTilesConnection::setTile()") << "Unable to insert map.";
-                    return false;
+                    ++numWritten;
                 }
             }
-            else
-            {
-                return true;
-            }
 
+            // Commit all tiles at once.
+            transaction.commit();
+
+            return numWritten;
         }
         catch (const std::exception& e)
         {
-            ofLogError("MBTilesConnection::setTile()") << "INSERTING MAP SQLite exception: " << e.what() << " " << index() << " " << useCount();
-            return false;
+            ofLogError("MBTilesConnection::setTiles()") << "SQLite exception: " << e.what();
+            return 0;
         }
-
     }
     else
     {
-        ofLogError("MBTilesConnection::setTile()") << "No setting data on a read-only database.";
-        return false;
+        ofLogError("MBTilesConnection::setTiles()") << "No setting data on a read-only database.";
+        return 0;
     }
 }
 
@@ -583,6 +674,174 @@ std::shared_ptr<ofBuffer> MBTilesConnection::getBuffer(const TileKey& key) const
 }
 
 
+bool MBTilesConnection::readBuffer(const TileKey& key,
+                                   TileDataCallback reader,
+                                   TileFreshness* freshness) const noexcept
+{
+    try
+    {
+        SQLite::Statement& query = getStatement(key.setId().empty() ? QUERY_TILES_WITH_FRESHNESS : QUERY_TILES_WITH_FRESHNESS_WITH_SET_ID);
+
+        query.bind(":tile_row", key.row());
+        query.bind(":zoom_level", key.zoom());
+        query.bind(":tile_column", key.column());
+
+        if (!key.setId().empty())
+        {
+            query.bind(":set_id", key.setId());
+        }
+
+        if (query.executeStep())
+        {
+            auto column = query.getColumn("tile_data");
+
+            if (column.isBlob())
+            {
+                if (freshness != nullptr)
+                {
+                    freshness->cachedDate = query.getColumn("tile_cached_date").getInt64();
+                    freshness->expiresDate = query.getColumn("tile_expires_date").getInt64();
+                    freshness->eTag = query.getColumn("tile_etag").getString();
+                    freshness->lastModified = query.getColumn("tile_last_modified").getString();
+                }
+
+                // The blob pointer is valid until the statement is stepped or
+                // reset, so the reader must finish with it before we return.
+                return reader(reinterpret_cast<const char*>(column.getBlob()), column.getBytes());
+            }
+            else
+            {
+                ofLogError("MBTilesConnection::readBuffer") << "Tile data existed, but wasn't a blob: " << this->database().getFilename() << " " << key.toString();
+                return false;
+            }
+        }
+        else
+        {
+            // We simply don't have it.
+            return false;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::readBuffer") << "SQLite exception: " << e.what();
+        return false;
+    }
+}
+
+
+void MBTilesConnection::getBuffers(const std::vector<TileKey>& keys,
+                                   TileBufferCallback callback) const noexcept
+{
+    // Sort so that each (set, zoom) run is contiguous and Hilbert ordered.
+    std::vector<TileKey> sortedKeys(keys);
+    std::sort(sortedKeys.begin(), sortedKeys.end(), TileKey::HilbertOrder());
+
+    std::vector<uint64_t> indices;
+    indices.reserve(sortedKeys.size());
+
+    for (const auto& key: sortedKeys)
+    {
+        indices.push_back(key.hilbertIndex());
+    }
+
+    std::size_t index = 0;
+    std::size_t numReported = 0;
+
+    try
+    {
+        while (index < sortedKeys.size())
+        {
+            const TileKey& first = sortedKeys[index];
+            const std::string& setId = first.setId();
+
+            // Find the end of this run, splitting it where the curve leaves
+            // the requested region for too long.
+            std::size_t end = index + 1;
+
+            while (end < sortedKeys.size()
+               &&  sortedKeys[end].zoom() == first.zoom()
+               &&  sortedKeys[end].setId() == setId
+               &&  indices[end] - indices[end - 1] <= MAX_HILBERT_GAP)
+            {
+                ++end;
+            }
+
+            SQLite::Statement& query = getStatement(setId.empty() ? QUERY_TILE_HILBERT_RANGE : QUERY_TILE_HILBERT_RANGE_WITH_SET_ID);
+
+            query.bind(":zoom_level", first.zoom());
+            query.bind(":min_tile_hilbert", static_cast<int64_t>(indices[index]));
+            query.bind(":max_tile_hilbert", static_cast<int64_t>(indices[end - 1]));
+
+            if (!setId.empty())
+            {
+                query.bind(":set_id", setId);
+            }
+
+            bool hasRow = query.executeStep();
+            std::shared_ptr<ofBuffer> buffer = nullptr;
+            TileFreshness freshness;
+
+            // Merge the ordered results with the ordered keys.
+            for (; index < end; ++index)
+            {
+                const TileKey& key = sortedKeys[index];
+                int64_t hilbert = static_cast<int64_t>(indices[index]);
+
+                while (hasRow && query.getColumn(0).getInt64() < hilbert)
+                {
+                    buffer = nullptr;
+                    freshness = TileFreshness();
+                    hasRow = query.executeStep();
+                }
+
+                if (hasRow && query.getColumn(0).getInt64() == hilbert)
+                {
+                    // Duplicate keys share the buffer.
+                    if (buffer == nullptr)
+                    {
+                        auto column = query.getColumn(1);
+
+                        if (column.isBlob())
+                        {
+                            buffer = std::make_shared<ofBuffer>(reinterpret_cast<const char*>(column.getBlob()), column.getBytes());
+                            freshness.cachedDate = query.getColumn("tile_cached_date").getInt64();
+                            freshness.expiresDate = query.getColumn("tile_expires_date").getInt64();
+                            freshness.eTag = query.getColumn("tile_etag").getString();
+                            freshness.lastModified = query.getColumn("tile_last_modified").getString();
+                        }
+                        else
+                        {
+                            ofLogError("MBTilesConnection::getBuffers") << "Tile data existed, but wasn't a blob: " << this->database().getFilename() << " " << key.toString();
+                        }
+                    }
+
+                    callback(key, buffer, freshness);
+                }
+                else
+                {
+                    // We simply don't have it.
+                    callback(key, nullptr, TileFreshness());
+                }
+
+                ++numReported;
+            }
+
+            query.reset();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::getBuffers") << "SQLite exception: " << e.what();
+
+        // Report the keys that weren't reached as missing.
+        for (; numReported < sortedKeys.size(); ++numReported)
+        {
+            callback(sortedKeys[numReported], nullptr, TileFreshness());
+        }
+    }
+}
+
+
 size_t MBTilesConnection::size() const noexcept
 {
     try
@@ -601,130 +860,814 @@ size_t MBTilesConnection::size() const noexcept
 
 
 
-std::shared_ptr<Tile> MBTilesConnection::getTile(const TileKey& key) const noexcept
+std::unique_ptr<TilePresenceIndex> MBTilesConnection::buildPresenceIndex() const noexcept
 {
-    auto buffer = getBuffer(key);
-
-    if (buffer != nullptr)
+    try
     {
-        ofPixels pixels;
+        SQLite::Statement& count = getStatement(COUNT_MAP_KEYS);
+        count.executeStep();
 
-        if (ofLoadImage(pixels, *buffer))
-        {
-            return std::make_shared<Tile>(pixels);
-        }
-        else
+        // Leave room for the cache to double before false positives climb.
+        std::size_t capacity = std::max(static_cast<std::size_t>(count.getColumn(0).getInt64()) * 2,
+                                        static_cast<std::size_t>(TilePresenceIndex::DEFAULT_CAPACITY));
+
+        auto index = std::make_unique<TilePresenceIndex>(capacity);
+
+        SQLite::Statement& query = getStatement(QUERY_MAP_KEYS);
+
+        while (query.executeStep())
         {
-            ofLogError("MBTilesConnection::getTile") << "Error loading pixels.";
-            return nullptr;
+            auto setId = query.getColumn(3);
+
+            index->add(query.getColumn(0).getInt64(),
+                       query.getColumn(1).getInt64(),
+                       query.getColumn(2).getInt64(),
+                       setId.isNull() ? TileKey::DEFAULT_SET_ID : setId.getString());
         }
+
+        return index;
     }
-    else
+    catch (const std::exception& e)
     {
+        ofLogError("MBTilesConnection::buildPresenceIndex") << "SQLite exception: " << e.what();
         return nullptr;
     }
 }
 
 
-MBTilesCache::MBTilesCache(const MapTileProvider& tileProvider,
-                           const std::string& cachePath,
-                           uint64_t databaseTimeoutMilliseconds,
-                           std::size_t capacity,
-                           std::size_t peakCapacity)
+bool MBTilesConnection::touchTile(const TileKey& key) noexcept
 {
-    std::filesystem::create_directories(ofToDataPath(cachePath, true));
-    std::filesystem::path tilePath = cachePath;
-    tilePath /= (tileProvider.id() + ".mbtiles");
-    
     try
     {
-        _writeConnection = std::make_unique<MBTilesConnection>(tilePath.string(),
-                                                               SQLite::SQLiteConnection::Mode::READ_WRITE_CREATE,
-                                                               databaseTimeoutMilliseconds),
-        
-        _readConnectionPool = std::make_unique<MBTilesConnectionPool>(tilePath.string(),
-                                                                      SQLite::SQLiteConnection::Mode::READ_ONLY,
-                                                                      databaseTimeoutMilliseconds,
-                                                                      capacity,
-                                                                      peakCapacity);
-        
-        SQLite::Transaction transaction(_writeConnection->database());
-        _writeConnection->database().exec(MBTilesConnection::MBTILES_SCHEMA);
-        transaction.commit();
+        SQLite::Statement& query = getStatement(key.setId().empty() ? TOUCH_MAP : TOUCH_MAP_WITH_SET_ID);
+        query.bind(":tile_column", key.column());
+        query.bind(":tile_row", key.row());
+        query.bind(":zoom_level", key.zoom());
 
-        _writeConnection->database().exec("PRAGMA journal_mode=WAL");
+        if (!key.setId().empty())
+        {
+            query.bind(":set_id", key.setId());
+        }
 
+        return query.exec() > 0;
     }
     catch (const std::exception& e)
     {
-        ofLogError("MBTilesConnection::MBTilesConnection()") << "Error initializing database - SQLite exception: " << e.what();
+        ofLogError("MBTilesConnection::touchTile") << "SQLite exception: " << e.what();
+        return false;
     }
+}
+
 
+bool MBTilesConnection::refreshTile(const TileKey& key,
+                                    const TileFreshness& freshness) noexcept
+{
     try
     {
-        MBTilesMetadata metadata;
-        metadata.set(MBTilesMetadata::KEY_MIN_ZOOM, std::to_string(tileProvider.minZoom()));
-        metadata.set(MBTilesMetadata::KEY_MAX_ZOOM, std::to_string(tileProvider.maxZoom()));
-        metadata.set(MBTilesMetadata::KEY_BOUNDS, tileProvider.bounds().toString());
-        metadata.set(MBTilesMetadata::KEY_CENTER, tileProvider.center().toString());
-        metadata.set(MBTilesMetadata::KEY_NAME, tileProvider.name());
-        metadata.set(MBTilesMetadata::KEY_ATTRIBUTION, tileProvider.attribution());
-
-        auto dictionary = tileProvider.dictionary();
+        SQLite::Statement& query = getStatement(key.setId().empty() ? REFRESH_MAP : REFRESH_MAP_WITH_SET_ID);
+        query.bind(":tile_column", key.column());
+        query.bind(":tile_row", key.row());
+        query.bind(":zoom_level", key.zoom());
+        query.bind(":tile_cached_date", freshness.cachedDate != 0 ? freshness.cachedDate : static_cast<int64_t>(Poco::Timestamp().epochTime()));
+        query.bind(":tile_expires_date", freshness.expiresDate);
+        query.bind(":tile_etag", freshness.eTag);
+        query.bind(":tile_last_modified", freshness.lastModified);
 
-        auto dictAdd = [&](const std::string& key)
+        if (!key.setId().empty())
         {
-            if (dictionary.find(key) != dictionary.end())
-                metadata.set(key, dictionary.find(key)->second);
-        };
+            query.bind(":set_id", key.setId());
+        }
 
-        dictAdd(MBTilesMetadata::KEY_TYPE);
-        dictAdd(MBTilesMetadata::KEY_VERSION);
-        dictAdd(MBTilesMetadata::KEY_FORMAT);
+        return query.exec() > 0;
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::refreshTile") << "SQLite exception: " << e.what();
+        return false;
+    }
+}
 
-        _writeConnection->setMetaData(metadata);
+
+bool MBTilesConnection::setMissing(const TileKey& key,
+                                   int64_t expiresDate) noexcept
+{
+    try
+    {
+        SQLite::Statement& query = getStatement(INSERT_MISSING);
+        query.bind(":tile_column", key.column());
+        query.bind(":tile_row", key.row());
+        query.bind(":zoom_level", key.zoom());
+        query.bind(":set_id", key.setId());
+        query.bind(":expires_date", expiresDate);
+        return query.exec() > 0;
     }
     catch (const std::exception& e)
     {
-        ofLogError("MBTilesConnection::MBTilesConnection()") << "Error setting metadata - SQLite exception: " << e.what();
+        ofLogError("MBTilesConnection::setMissing") << "SQLite exception: " << e.what();
+        return false;
     }
+}
 
-    _writeThread = std::thread([&]() {
 
-        std::pair<TileKey, std::shared_ptr<ofBuffer>> value;
-        while (_writeChannel.receive(value))
+bool MBTilesConnection::isMissing(const TileKey& key,
+                                  int64_t now,
+                                  int64_t* expiresDate) const noexcept
+{
+    try
+    {
+        SQLite::Statement& query = getStatement(QUERY_MISSING);
+        query.bind(":tile_column", key.column());
+        query.bind(":tile_row", key.row());
+        query.bind(":zoom_level", key.zoom());
+        query.bind(":set_id", key.setId());
+
+        if (query.executeStep())
         {
-            try
-            {
-                if (!_writeConnection->has(value.first))
-                {
-                    _writeConnection->setTile(value.first, *value.second);
-                }
-            }
-            catch (const std::exception& e)
+            int64_t expires = query.getColumn(0).getInt64();
+
+            if (expiresDate != nullptr)
             {
-                ofLogError("MBTilesConnection::MBTilesConnection()") << "Error setting tile - SQLite exception: " << e.what();
+                *expiresDate = expires;
             }
-        }
-    });
-}
 
+            return expires > now;
+        }
 
-MBTilesCache::~MBTilesCache()
-{
-    _writeChannel.close();
-    _writeThread.join();
+        return false;
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::isMissing") << "SQLite exception: " << e.what();
+        return false;
+    }
 }
 
 
-const MBTilesCache::MBTilesConnectionPool& MBTilesCache::readConnectionPool() const
+bool MBTilesConnection::removeMissing(const TileKey& key) noexcept
 {
-    return *_readConnectionPool;
-}
+    try
+    {
+        SQLite::Statement& query = getStatement(DELETE_MISSING);
+        query.bind(":tile_column", key.column());
+        query.bind(":tile_row", key.row());
+        query.bind(":zoom_level", key.zoom());
+        query.bind(":set_id", key.setId());
+        query.exec();
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::removeMissing") << "SQLite exception: " << e.what();
+        return false;
+    }
+}
+
+
+std::size_t MBTilesConnection::removeExpiredMissing(int64_t now) noexcept
+{
+    try
+    {
+        SQLite::Statement& query = getStatement(DELETE_EXPIRED_MISSING);
+        query.bind(":now", now);
+        return query.exec();
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::removeExpiredMissing") << "SQLite exception: " << e.what();
+        return 0;
+    }
+}
+
+
+bool MBTilesConnection::removeTile(const TileKey& key) noexcept
+{
+    try
+    {
+        SQLite::Statement& query = getStatement(key.setId().empty() ? QUERY_MAP_ROWS : QUERY_MAP_ROWS_WITH_SET_ID);
+        query.bind(":tile_column", key.column());
+        query.bind(":tile_row", key.row());
+        query.bind(":zoom_level", key.zoom());
+
+        if (!key.setId().empty())
+        {
+            query.bind(":set_id", key.setId());
+        }
+
+        _deleteMapRows(query);
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::removeTile") << "SQLite exception: " << e.what();
+        return false;
+    }
+}
+
+
+std::size_t MBTilesConnection::evictTiles(std::size_t count) noexcept
+{
+    try
+    {
+        SQLite::Transaction transaction(_database);
+
+        SQLite::Statement& query = getStatement(QUERY_LEAST_RECENTLY_USED_MAP_ROWS);
+        query.bind(":limit", static_cast<int64_t>(count));
+
+        std::size_t numEvicted = _deleteMapRows(query);
+
+        transaction.commit();
+
+        return numEvicted;
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::evictTiles") << "SQLite exception: " << e.what();
+        return 0;
+    }
+}
+
+
+bool MBTilesConnection::clear() noexcept
+{
+    try
+    {
+        _database.exec(DELETE_ALL_MAP);
+        _database.exec(DELETE_ALL_IMAGES);
+        _database.exec(DELETE_ALL_MISSING);
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::clear") << "SQLite exception: " << e.what();
+        return false;
+    }
+}
+
+
+void MBTilesConnection::incrementalVacuum(std::size_t maxPages) noexcept
+{
+    try
+    {
+        _database.exec("PRAGMA incremental_vacuum(" + std::to_string(maxPages) + ")");
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::incrementalVacuum") << "SQLite exception: " << e.what();
+    }
+}
+
+
+uint64_t MBTilesConnection::usedBytes() const noexcept
+{
+    try
+    {
+        SQLite::Statement& pageCount = getStatement("PRAGMA page_count");
+        pageCount.executeStep();
+        int64_t numPages = pageCount.getColumn(0).getInt64();
+
+        SQLite::Statement& freelistCount = getStatement("PRAGMA freelist_count");
+        freelistCount.executeStep();
+        int64_t numFreePages = freelistCount.getColumn(0).getInt64();
+
+        SQLite::Statement& pageSize = getStatement("PRAGMA page_size");
+        pageSize.executeStep();
+        int64_t bytesPerPage = pageSize.getColumn(0).getInt64();
+
+        return static_cast<uint64_t>(std::max(numPages - numFreePages, int64_t(0)) * bytesPerPage);
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::usedBytes") << "SQLite exception: " << e.what();
+        return 0;
+    }
+}
+
+
+bool MBTilesConnection::upgradeSchema() noexcept
+{
+    // Columns added to the map table since the cache was first released.
+    static const std::vector<std::pair<std::string, std::string>> mapColumns =
+    {
+        { "tile_accessed_date", "INTEGER DEFAULT 0" },
+        { "tile_cached_date", "INTEGER DEFAULT 0" },
+        { "tile_expires_date", "INTEGER DEFAULT 0" },
+        { "tile_etag", "TEXT" },
+        { "tile_last_modified", "TEXT" },
+        { "tile_hilbert", "INTEGER" }
+    };
+
+    try
+    {
+        SQLite::Statement& userVersion = getStatement("PRAGMA user_version");
+        userVersion.executeStep();
+        int64_t version = userVersion.getColumn(0).getInt64();
+        userVersion.reset();
+
+        if (_database.tableExists("map"))
+        {
+            for (const auto& column: mapColumns)
+            {
+                if (!hasColumn("map", column.first))
+                {
+                    _database.exec("ALTER TABLE `map` ADD COLUMN " + column.first + " " + column.second);
+                }
+            }
+
+            // Tiles are written with their Hilbert index, so only databases
+            // from before the column existed need the full table scan.
+            if (version < SCHEMA_VERSION)
+            {
+                _backfillHilbert();
+            }
+        }
+
+        // Only marked after a successful backfill, so a failed one is retried.
+        if (version < SCHEMA_VERSION)
+        {
+            _database.exec("PRAGMA user_version = " + std::to_string(SCHEMA_VERSION));
+        }
+
+        return true;
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::upgradeSchema") << "SQLite exception: " << e.what();
+        return false;
+    }
+}
+
+
+bool MBTilesConnection::hasColumn(const std::string& table,
+                                  const std::string& column) const noexcept
+{
+    try
+    {
+        SQLite::Statement& query = getStatement("PRAGMA table_info(`" + table + "`)");
+
+        while (query.executeStep())
+        {
+            if (query.getColumn("name").getString() == column)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::hasColumn") << "SQLite exception: " << e.what();
+        return false;
+    }
+}
+
+
+void MBTilesConnection::_backfillHilbert()
+{
+    struct Row
+    {
+        int64_t rowId;
+        uint64_t hilbert;
+    };
+
+    // Collect first so the table isn't updated while it is being read.
+    std::vector<Row> rows;
+
+    SQLite::Statement& query = getStatement(QUERY_MAP_ROWS_WITHOUT_HILBERT);
+
+    while (query.executeStep())
+    {
+        rows.push_back({ query.getColumn(0).getInt64(),
+                         TileKey::hilbertIndex(query.getColumn(2).getInt64(),
+                                               query.getColumn(3).getInt64(),
+                                               query.getColumn(1).getInt64()) });
+    }
+
+    query.reset();
+
+    if (rows.empty())
+    {
+        return;
+    }
+
+    SQLite::Transaction transaction(_database);
+
+    SQLite::Statement& update = getStatement(UPDATE_MAP_HILBERT);
+
+    for (const auto& row: rows)
+    {
+        update.bind(":tile_hilbert", static_cast<int64_t>(row.hilbert));
+        update.bind(":rowid", row.rowId);
+        update.exec();
+        update.reset();
+    }
+
+    transaction.commit();
+}
+
+
+std::size_t MBTilesConnection::_deleteMapRows(SQLite::Statement& query)
+{
+    std::vector<int64_t> rowIds;
+    std::set<std::string> tileIds;
+
+    while (query.executeStep())
+    {
+        rowIds.push_back(query.getColumn(0).getInt64());
+        tileIds.insert(query.getColumn(1).getString());
+    }
+
+    SQLite::Statement& deleteMapRow = getStatement(DELETE_MAP_ROW);
+
+    for (auto rowId: rowIds)
+    {
+        deleteMapRow.bind(":rowid", rowId);
+        deleteMapRow.exec();
+        deleteMapRow.reset();
+    }
+
+    // Images may be shared by several tiles, so only delete unused images.
+    SQLite::Statement& deleteUnusedImage = getStatement(DELETE_UNUSED_IMAGE);
+
+    for (const auto& tileId: tileIds)
+    {
+        deleteUnusedImage.bind(":tile_id", tileId);
+        deleteUnusedImage.exec();
+        deleteUnusedImage.reset();
+    }
+
+    return rowIds.size();
+}
+
+
+std::shared_ptr<Tile> MBTilesConnection::getTile(const TileKey& key) const noexcept
+{
+    ofPixels pixels;
+
+    bool decoded = readBuffer(key, [&pixels](const char* data, std::size_t size)
+                                   {
+                                       return TileDecoder::decode(data, size, pixels);
+                                   });
+
+    if (decoded)
+    {
+        return std::make_shared<Tile>(std::move(pixels));
+    }
+    else
+    {
+        return nullptr;
+    }
+}
+
+
+MBTilesCache::MBTilesCache(const MapTileProvider& tileProvider,
+                           const std::string& cachePath,
+                           uint64_t databaseTimeoutMilliseconds,
+                           std::size_t capacity,
+                           std::size_t peakCapacity):
+    _maxBytes(0),
+    _writeBatchSize(DEFAULT_WRITE_BATCH_SIZE),
+    _writeBatchInterval(DEFAULT_WRITE_BATCH_INTERVAL)
+{
+    std::filesystem::create_directories(ofToDataPath(cachePath, true));
+    std::filesystem::path tilePath = cachePath;
+    tilePath /= (tileProvider.id() + ".mbtiles");
+    
+    try
+    {
+        _writeConnection = std::make_unique<MBTilesConnection>(tilePath.string(),
+                                                               SQLite::SQLiteConnection::Mode::READ_WRITE_CREATE,
+                                                               databaseTimeoutMilliseconds),
+        
+        _readConnectionPool = std::make_unique<MBTilesConnectionPool>(tilePath.string(),
+                                                                      SQLite::SQLiteConnection::Mode::READ_ONLY,
+                                                                      databaseTimeoutMilliseconds,
+                                                                      capacity,
+                                                                      peakCapacity);
+        
+        // Only takes effect for new databases, but lets eviction shrink them.
+        _writeConnection->database().exec("PRAGMA auto_vacuum=INCREMENTAL");
+
+        _writeConnection->upgradeSchema();
+
+        SQLite::Transaction transaction(_writeConnection->database());
+        _writeConnection->database().exec(MBTilesConnection::MBTILES_SCHEMA);
+        transaction.commit();
+
+        _writeConnection->database().exec("PRAGMA journal_mode=WAL");
+
+        _presenceIndex = _writeConnection->buildPresenceIndex();
+
+        _writeConnection->removeExpiredMissing(Poco::Timestamp().epochTime());
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::MBTilesConnection()") << "Error initializing database - SQLite exception: " << e.what();
+    }
+
+    try
+    {
+        MBTilesMetadata metadata;
+        metadata.set(MBTilesMetadata::KEY_MIN_ZOOM, std::to_string(tileProvider.minZoom()));
+        metadata.set(MBTilesMetadata::KEY_MAX_ZOOM, std::to_string(tileProvider.maxZoom()));
+        metadata.set(MBTilesMetadata::KEY_BOUNDS, tileProvider.bounds().toString());
+        metadata.set(MBTilesMetadata::KEY_CENTER, tileProvider.center().toString());
+        metadata.set(MBTilesMetadata::KEY_NAME, tileProvider.name());
+        metadata.set(MBTilesMetadata::KEY_ATTRIBUTION, tileProvider.attribution());
+
+        auto dictionary = tileProvider.dictionary();
+
+        auto dictAdd = [&](const std::string& key)
+        {
+            if (dictionary.find(key) != dictionary.end())
+                metadata.set(key, dictionary.find(key)->second);
+        };
+
+        dictAdd(MBTilesMetadata::KEY_TYPE);
+        dictAdd(MBTilesMetadata::KEY_VERSION);
+        dictAdd(MBTilesMetadata::KEY_FORMAT);
+
+        _writeConnection->setMetaData(metadata);
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesConnection::MBTilesConnection()") << "Error setting metadata - SQLite exception: " << e.what();
+    }
+
+    _writeThread = std::thread(&MBTilesCache::_write, this);
+}
+
+
+MBTilesCache::~MBTilesCache()
+{
+    _writeChannel.close();
+    _writeThread.join();
+}
+
+
+const MBTilesCache::MBTilesConnectionPool& MBTilesCache::readConnectionPool() const
+{
+    return *_readConnectionPool;
+}
+
+
+void MBTilesCache::setWriteBatchSize(std::size_t writeBatchSize)
+{
+    _writeBatchSize = std::max(writeBatchSize, std::size_t(1));
+}
+
+
+std::size_t MBTilesCache::getWriteBatchSize() const
+{
+    return _writeBatchSize;
+}
+
+
+void MBTilesCache::setWriteBatchInterval(uint64_t writeBatchIntervalMilliseconds)
+{
+    _writeBatchInterval = writeBatchIntervalMilliseconds;
+}
+
+
+uint64_t MBTilesCache::getWriteBatchInterval() const
+{
+    return _writeBatchInterval;
+}
+
+
+void MBTilesCache::setMaxBytes(uint64_t maxBytes)
+{
+    _maxBytes = maxBytes;
+}
+
+
+uint64_t MBTilesCache::getMaxBytes() const
+{
+    return _maxBytes;
+}
+
+
+uint64_t MBTilesCache::usedBytes() const
+{
+    auto connection = _readConnectionPool->borrowObject();
+    auto result = connection->usedBytes();
+    _readConnectionPool->returnObject(connection);
+    return result;
+}
+
+
+void MBTilesCache::_write()
+{
+    std::vector<WriteRequest> batch;
+    WriteRequest value;
+
+    // Block until the first request of a batch arrives.
+    while (_writeChannel.receive(value))
+    {
+        batch.push_back(std::move(value));
+
+        std::size_t batchSize = _writeBatchSize;
+
+        auto deadline = std::chrono::steady_clock::now()
+                      + std::chrono::milliseconds(_writeBatchInterval);
+
+        // Drain the channel until the batch is full or the window closes.
+        while (batch.size() < batchSize)
+        {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+
+            if (remaining <= 0 || !_writeChannel.tryReceive(value, remaining))
+            {
+                break;
+            }
+
+            batch.push_back(std::move(value));
+        }
+
+        // Write runs of new tiles in Hilbert order so neighbouring tiles share
+        // pages. Other requests keep their order relative to the adds.
+        auto runBegin = batch.begin();
+
+        while (runBegin != batch.end())
+        {
+            auto runEnd = std::find_if(runBegin,
+                                       batch.end(),
+                                       [](const WriteRequest& request)
+                                       {
+                                           return request.type != WriteRequest::Type::ADD;
+                                       });
+
+            std::stable_sort(runBegin,
+                             runEnd,
+                             [](const WriteRequest& request0, const WriteRequest& request1)
+                             {
+                                 return TileKey::HilbertOrder()(request0.key, request1.key);
+                             });
+
+            runBegin = (runEnd == batch.end()) ? runEnd : runEnd + 1;
+        }
+
+        _applyWriteRequests(batch);
+
+        batch.clear();
+
+        _evict();
+    }
+}
+
+
+void MBTilesCache::_applyWriteRequests(const std::vector<WriteRequest>& batch)
+{
+    try
+    {
+        SQLite::Transaction transaction(_writeConnection->database());
+
+        for (const auto& request: batch)
+        {
+            switch (request.type)
+            {
+                case WriteRequest::Type::ADD:
+                    if (request.buffer != nullptr)
+                    {
+                        // Index before writing, so a committed tile is never
+                        // reported missing.
+                        if (_presenceIndex != nullptr)
+                        {
+                            _presenceIndex->add(request.key);
+                        }
+
+                        _writeConnection->upsertTile(request.key, *request.buffer, request.freshness);
+                        _writeConnection->removeMissing(request.key);
+                    }
+                    break;
+                case WriteRequest::Type::REPLACE:
+                    if (request.buffer != nullptr)
+                    {
+                        if (_presenceIndex != nullptr)
+                        {
+                            _presenceIndex->add(request.key);
+                        }
+
+                        _writeConnection->removeTile(request.key);
+                        _writeConnection->upsertTile(request.key, *request.buffer, request.freshness);
+                        _writeConnection->removeMissing(request.key);
+                    }
+                    break;
+                case WriteRequest::Type::REFRESH:
+                    _writeConnection->refreshTile(request.key, request.freshness);
+                    break;
+                case WriteRequest::Type::TOUCH:
+                    _flushTouches();
+                    break;
+                case WriteRequest::Type::MISSING:
+                    _writeConnection->setMissing(request.key, request.freshness.expiresDate);
+                    break;
+                case WriteRequest::Type::REMOVE:
+                    // Removed tiles stay in the presence index and fall back
+                    // to a query.
+                    _writeConnection->removeTile(request.key);
+                    break;
+                case WriteRequest::Type::CLEAR:
+                    if (_presenceIndex != nullptr)
+                    {
+                        _presenceIndex->clear();
+                    }
+
+                    _writeConnection->clear();
+                    break;
+            }
+        }
+
+        // Commit the whole batch at once.
+        transaction.commit();
+    }
+    catch (const std::exception& e)
+    {
+        ofLogError("MBTilesCache::_applyWriteRequests") << "Error writing tiles - SQLite exception: " << e.what();
+    }
+}
+
+
+void MBTilesCache::_evict()
+{
+    uint64_t maxBytes = _maxBytes;
+
+    if (maxBytes == 0)
+    {
+        return;
+    }
+
+    uint64_t usedBytes = _writeConnection->usedBytes();
+
+    if (usedBytes <= maxBytes)
+    {
+        return;
+    }
+
+    // Evict down to a low water mark so we don't evict after every write.
+    uint64_t targetBytes = maxBytes - maxBytes / 10;
+
+    // Evict in short transactions so the read pool is never blocked for long.
+    for (int pass = 0; pass < MAX_EVICTION_PASSES && usedBytes > targetBytes; ++pass)
+    {
+        if (_writeConnection->evictTiles(EVICTION_BATCH_SIZE) == 0)
+        {
+            break;
+        }
+
+        usedBytes = _writeConnection->usedBytes();
+    }
+
+    _writeConnection->incrementalVacuum(MAX_VACUUM_PAGES);
+}
+
+
+void MBTilesCache::_touch(const TileKey& key) const
+{
+    if (_maxBytes > 0)
+    {
+        bool wasEmpty = false;
+
+        {
+            std::unique_lock<std::mutex> lock(_touchedMutex);
+            wasEmpty = _touched.empty();
+            _touched.insert(key);
+        }
+
+        // Only the first touch since the last flush wakes the writer.
+        if (wasEmpty)
+        {
+            WriteRequest request;
+            request.type = WriteRequest::Type::TOUCH;
+            _writeChannel.send(std::move(request));
+        }
+    }
+}
+
+
+void MBTilesCache::_flushTouches()
+{
+    std::set<TileKey> touched;
+
+    {
+        std::unique_lock<std::mutex> lock(_touchedMutex);
+        std::swap(touched, _touched);
+    }
+
+    for (const auto& key: touched)
+    {
+        _writeConnection->touchTile(key);
+    }
+}
 
 
 bool MBTilesCache::doHas(const TileKey& key) const
 {
+    if (_presenceIndex != nullptr && !_presenceIndex->mayContain(key))
+    {
+        return false;
+    }
+
     auto connection = _readConnectionPool->borrowObject();
     auto result = connection->has(key);
     _readConnectionPool->returnObject(connection);
@@ -732,24 +1675,164 @@ bool MBTilesCache::doHas(const TileKey& key) const
 }
 
 
+void MBTilesCache::getMany(const std::vector<TileKey>& keys,
+                           MBTilesConnection::TileBufferCallback callback) const
+{
+    std::vector<TileKey> candidates;
+
+    if (_presenceIndex != nullptr)
+    {
+        // Report tiles that are definitely missing without a query.
+        for (const auto& key: keys)
+        {
+            if (_presenceIndex->mayContain(key))
+            {
+                candidates.push_back(key);
+            }
+            else
+            {
+                callback(key, nullptr, TileFreshness());
+            }
+        }
+    }
+    else
+    {
+        candidates = keys;
+    }
+
+    if (!candidates.empty())
+    {
+        auto connection = _readConnectionPool->borrowObject();
+        connection->getBuffers(candidates, [&](const TileKey& key,
+                                               std::shared_ptr<ofBuffer> buffer,
+                                               const TileFreshness& freshness)
+                                           {
+                                               if (buffer != nullptr)
+                                               {
+                                                   _touch(key);
+                                               }
+
+                                               callback(key, buffer, freshness);
+                                           });
+        _readConnectionPool->returnObject(connection);
+    }
+}
+
+
+bool MBTilesCache::read(const TileKey& key,
+                        MBTilesConnection::TileDataCallback reader,
+                        TileFreshness* freshness) const
+{
+    if (_presenceIndex != nullptr && !_presenceIndex->mayContain(key))
+    {
+        return false;
+    }
+
+    auto connection = _readConnectionPool->borrowObject();
+    auto result = connection->readBuffer(key, reader, freshness);
+    _readConnectionPool->returnObject(connection);
+
+    if (result)
+    {
+        _touch(key);
+    }
+
+    return result;
+}
+
+
 std::shared_ptr<ofBuffer> MBTilesCache::doGet(const TileKey& key)
 {
+    if (_presenceIndex != nullptr && !_presenceIndex->mayContain(key))
+    {
+        return nullptr;
+    }
+
     auto connection = _readConnectionPool->borrowObject();
     auto result = connection->getBuffer(key);
     _readConnectionPool->returnObject(connection);
+
+    if (result != nullptr)
+    {
+        _touch(key);
+    }
+
+    return result;
+}
+
+
+void MBTilesCache::add(const TileKey& key,
+                       std::shared_ptr<ofBuffer> entry,
+                       const TileFreshness& freshness)
+{
+    WriteRequest request;
+    request.type = WriteRequest::Type::ADD;
+    request.key = key;
+    request.buffer = entry;
+    request.freshness = freshness;
+    _writeChannel.send(std::move(request));
+}
+
+
+void MBTilesCache::replace(const TileKey& key,
+                           std::shared_ptr<ofBuffer> entry,
+                           const TileFreshness& freshness)
+{
+    WriteRequest request;
+    request.type = WriteRequest::Type::REPLACE;
+    request.key = key;
+    request.buffer = entry;
+    request.freshness = freshness;
+    _writeChannel.send(std::move(request));
+}
+
+
+void MBTilesCache::refresh(const TileKey& key,
+                           const TileFreshness& freshness)
+{
+    WriteRequest request;
+    request.type = WriteRequest::Type::REFRESH;
+    request.key = key;
+    request.freshness = freshness;
+    _writeChannel.send(std::move(request));
+}
+
+
+void MBTilesCache::addMissing(const TileKey& key, int64_t expiresDate)
+{
+    WriteRequest request;
+    request.type = WriteRequest::Type::MISSING;
+    request.key = key;
+    request.freshness.expiresDate = expiresDate;
+    _writeChannel.send(std::move(request));
+}
+
+
+bool MBTilesCache::isMissing(const TileKey& key, int64_t* expiresDate) const
+{
+    auto connection = _readConnectionPool->borrowObject();
+    auto result = connection->isMissing(key, Poco::Timestamp().epochTime(), expiresDate);
+    _readConnectionPool->returnObject(connection);
     return result;
 }
 
 
 void MBTilesCache::doAdd(const TileKey& key, std::shared_ptr<ofBuffer> entry)
 {
-    _writeChannel.send(std::make_pair(key, entry));
+    WriteRequest request;
+    request.type = WriteRequest::Type::ADD;
+    request.key = key;
+    request.buffer = entry;
+    _writeChannel.send(std::move(request));
 }
 
 
 void MBTilesCache::doRemove(const TileKey& key)
 {
-    ofLogError("MBTilesCache::doRemove") << "Not yet implemented.";
+    WriteRequest request;
+    request.type = WriteRequest::Type::REMOVE;
+    request.key = key;
+    _writeChannel.send(std::move(request));
 }
 
 
@@ -764,7 +1847,9 @@ std::size_t MBTilesCache::doSize()
 
 void MBTilesCache::doClear()
 {
-    ofLogError("MBTilesCache::doClear") << "Not yet implemented.";
+    WriteRequest request;
+    request.type = WriteRequest::Type::CLEAR;
+    _writeChannel.send(std::move(request));
 }
 
 
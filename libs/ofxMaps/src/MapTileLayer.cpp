@@ -6,7 +6,9 @@
 
 
 #include "ofx/Maps/MapTileLayer.h"
+#include <algorithm>
 #include "ofGraphics.h"
+#include "ofUtils.h"
 
 
 namespace ofx {
@@ -60,9 +62,48 @@ void MapTileLayer::update()
 
     if (_coordsDirty)
     {
-        _visisbleCoords = calculateVisibleCoordinates();
+        updateVisibleCoordinates();
         _coordsDirty = false;
     }
+
+    // Tiles evicted while visible go back to waiting.
+    if (!_evictedCoords.empty())
+    {
+        for (const auto& coord: _evictedCoords)
+        {
+            auto iter = std::find(_visibleCoords.begin(), _visibleCoords.end(), coord);
+
+            if (iter != _visibleCoords.end())
+            {
+                _visibleCoords.erase(iter);
+                _missingCoords.push_back(coord);
+            }
+        }
+
+        _evictedCoords.clear();
+        _fallbacksDirty = true;
+
+        requestTiles(_missingCoords);
+    }
+
+    if (_fallbacksDirty)
+    {
+        resolveFallbacks();
+        _fallbacksDirty = false;
+    }
+
+    // Skipped or failed tiles may be loadable now that time has passed.
+    if (_retryTime != 0 && ofGetElapsedTimeMillis() >= _retryTime)
+    {
+        _retryTime = 0;
+
+        if (!_missingCoords.empty())
+        {
+            requestTiles(_missingCoords);
+        }
+    }
+
+    submitPendingRequests();
 }
 
 
@@ -72,9 +113,51 @@ void MapTileLayer::draw(float x, float y) const
 
 //    ofClear(0, 0, 0);
 
-    std::set<TileCoordinate>::const_reverse_iterator iter = _visisbleCoords.rbegin();
+    // Draw substitutes for missing tiles first, under any loaded tiles.
+    for (const auto& fallback: _fallbacks)
+    {
+        auto tile = getTile(fallback.source);
+
+        if (tile == nullptr)
+        {
+            _fallbacksDirty = true;
+            continue;
+        }
 
-    while (iter != _visisbleCoords.rend())
+        const TileCoordinate& coord = fallback.coordinate;
+        const TileCoordinate& source = fallback.source;
+
+        glm::vec2 position = tileToPixels(coord);
+        auto dZoom = _center.getZoom() - coord.getZoom();
+        double scale = dZoom < 1 ? 1 : std::pow(2.0, dZoom);
+        glm::dvec2 tileSize = _tiles->provider()->tileSize() * scale;
+
+        int levels = coord.getFlooredZoom() - source.getFlooredZoom();
+
+        if (levels > 0)
+        {
+            // Crop the part of the ancestor covering this tile.
+            int64_t divisions = int64_t(1) << levels;
+            float sw = tile->getWidth() / divisions;
+            float sh = tile->getHeight() / divisions;
+            float sx = (coord.getFlooredColumn() - source.getFlooredColumn() * divisions) * sw;
+            float sy = (coord.getFlooredRow() - source.getFlooredRow() * divisions) * sh;
+
+            tile->drawSubsection(position.x, position.y, tileSize.x, tileSize.y, sx, sy, sw, sh);
+        }
+        else
+        {
+            // Draw the child in its quarter of this tile.
+            double dx = (source.getFlooredColumn() - coord.getFlooredColumn() * 2) * tileSize.x / 2;
+            double dy = (source.getFlooredRow() - coord.getFlooredRow() * 2) * tileSize.y / 2;
+
+            tile->draw(position.x + dx, position.y + dy, tileSize.x / 2, tileSize.y / 2);
+        }
+    }
+
+    auto iter = _visibleCoords.begin();
+
+    while (iter != _visibleCoords.end())
     {
         const TileCoordinate& coord = *iter;
 
@@ -102,6 +185,9 @@ void MapTileLayer::draw(float x, float y) const
         }
         else
         {
+            // Evicted since it was loaded, so have update() request it again.
+            _evictedCoords.push_back(coord);
+
             ofPushStyle();
             ofNoFill();
             ofSetColor(255, 127);
@@ -197,7 +283,19 @@ void MapTileLayer::setCenter(const Geo::Coordinate& center, double zoom)
 }
 
 
-std::set<TileCoordinate> MapTileLayer::calculateVisibleCoordinates() const
+void MapTileLayer::setMaxOutstandingRequests(std::size_t maxOutstandingRequests)
+{
+    _maxOutstandingRequests = std::max(std::size_t(1), maxOutstandingRequests);
+}
+
+
+std::size_t MapTileLayer::getMaxOutstandingRequests() const
+{
+    return _maxOutstandingRequests;
+}
+
+
+MapTileLayer::TileRange MapTileLayer::calculateVisibleRange() const
 {
     // Round the current zoom in case we are in between levels.
     int baseZoom = glm::clamp(static_cast<int>(std::round(_center.getZoom())),
@@ -248,82 +346,162 @@ std::set<TileCoordinate> MapTileLayer::calculateVisibleCoordinates() const
     minRow = glm::clamp(minRow, 0, gridSize);
     maxRow = glm::clamp(maxRow, 0, gridSize);
 
-    std::set<TileCoordinate> coordinatesToDraw;
-    std::set<TileCoordinate> requestedCoordinates;
+    TileRange range;
+    range.zoom = baseZoom;
+    range.minColumn = minCol;
+    range.minRow = minRow;
+    range.maxColumn = maxCol;
+    range.maxRow = maxRow;
+    return range;
+}
+
 
-    // Collect visible tile coordinates.
+void MapTileLayer::updateVisibleCoordinates()
+{
+    TileRange range = calculateVisibleRange();
 
-    for (int col = minCol; col < maxCol; ++col)
+    if (range == _visibleRange)
     {
-        for (int row = minRow; row < maxRow; ++row)
-        {
-            TileCoordinate coord(col, row, baseZoom);
+        return;
+    }
+
+    // Panning at the same zoom only needs the newly exposed tiles. Anything
+    // else starts over.
+    bool isIncremental = (range.zoom == _visibleRange.zoom);
+
+    auto isOutside = [&range](const TileCoordinate& coordinate)
+                     {
+                         return !range.contains(coordinate.getFlooredColumn(),
+                                                coordinate.getFlooredRow());
+                     };
 
-            // Do we have this tile?
-            if (!hasTile(coord))
+    if (isIncremental)
+    {
+        _visibleCoords.erase(std::remove_if(_visibleCoords.begin(),
+                                            _visibleCoords.end(),
+                                            isOutside),
+                             _visibleCoords.end());
+
+        _missingCoords.erase(std::remove_if(_missingCoords.begin(),
+                                            _missingCoords.end(),
+                                            isOutside),
+                             _missingCoords.end());
+    }
+    else
+    {
+        _visibleCoords.clear();
+        _missingCoords.clear();
+    }
+
+    for (int col = range.minColumn; col < range.maxColumn; ++col)
+    {
+        for (int row = range.minRow; row < range.maxRow; ++row)
+        {
+            if (!isIncremental || !_visibleRange.contains(col, row))
             {
-                requestedCoordinates.insert(coord);
+                addVisibleCoordinate(TileCoordinate(col, row, range.zoom));
+            }
+        }
+    }
 
-//                // Since we don't have this coordinate, let's try to find an
-//                // existing coordinate at a different scale that we can draw in
-//                // its place.
-//
-//                // First we look backwards from the current zoom level.
-//
-//                bool foundParent = false;
-//
-//				for (int i = coord.getZoom(); i >= _tiles->provider()->minZoom(); --i)
-//                {
-//                    auto parentCoord = coord.getZoomedTo(i);
-//
-//                    parentCoord = TileCoordinate(parentCoord.getFlooredColumn(),
-//                                                 parentCoord.getFlooredRow(),
-//                                                 parentCoord.getZoom());
-//
-//                    parentCoord = parentCoord.getClampedRowAndColumn();
-//
-//                    if (!hasTile(coord))
-//                    {
-//                        // We don't have the parent coordinate, so let's request
-//                        // it.
-//                        requestedCoordinates.insert(parentCoord);
-//                    }
-//                    else
-//                    {
-//                        // If we do have the parent coordinate, add it to the
-//                        // drawing queue.
-//                        coordinatesToDraw.insert(parentCoord);
-//                        foundParent = true;
-//                        break;
-//                    }
-//				}
-
-
-//                if (!foundParent)
-//                {
-//					TileCoordinate zoomed = coord.getZoomedBy(1);
-//					std::vector<TileCoordinate> kids;
-//					kids.push_back(zoomed);
-//					kids.push_back(zoomed.getCoordinateRight());
-//					kids.push_back(zoomed.getCoordinateDown());
-//					kids.push_back(zoomed.getCoordinateRight().getCoordinateDown());
-//					for (int i = 0; i < kids.size(); ++i)
-//                    {
-//                        coordinatesToDraw.insert(kids[i]);
-//					}
-//				}
+    _visibleRange = range;
+    _fallbacksDirty = true;
+
+    requestTiles(_missingCoords);
+}
+
+
+void MapTileLayer::addVisibleCoordinate(const TileCoordinate& coord)
+{
+    // Do we have this tile?
+    if (!hasTile(coord))
+    {
+        // A cached tile from another zoom is drawn in its place until it
+        // loads. See resolveFallbacks().
+        _missingCoords.push_back(coord);
+    }
+    else
+    {
+        // We have it so, add it to the drawing queue.
+        _visibleCoords.push_back(coord);
+    }
+}
+
+
+void MapTileLayer::resolveFallbacks()
+{
+    _fallbacks.clear();
+
+    int minZoom = _tiles->provider()->minZoom();
+    int maxZoom = _tiles->provider()->maxZoom();
+
+    for (const auto& coord: _missingCoords)
+    {
+        int64_t column = coord.getFlooredColumn();
+        int64_t row = coord.getFlooredRow();
+        int zoom = coord.getFlooredZoom();
+
+        bool foundParent = false;
+
+        // First look for the nearest loaded ancestor.
+        for (int parentZoom = zoom - 1; parentZoom >= minZoom; --parentZoom)
+        {
+            int levels = zoom - parentZoom;
+
+            TileCoordinate parent(column >> levels, row >> levels, parentZoom);
+
+            if (hasTile(parent))
+            {
+                _fallbacks.push_back({ coord, parent });
+                foundParent = true;
+                break;
             }
-            else
+        }
+
+        // Otherwise use whichever of the four children are loaded.
+        if (!foundParent && zoom < maxZoom)
+        {
+            for (int64_t i = 0; i < 4; ++i)
             {
-                // We have it so, add it to the drawing queue.
-                coordinatesToDraw.insert(coord);
+                TileCoordinate child(column * 2 + (i % 2), row * 2 + (i / 2), zoom + 1);
+
+                if (hasTile(child))
+                {
+                    _fallbacks.push_back({ coord, child });
+                }
             }
         }
     }
+}
 
-    requestTiles(requestedCoordinates);
 
-    return coordinatesToDraw;
+void MapTileLayer::invalidateVisibleCoordinates()
+{
+    _visibleRange = TileRange();
+    _coordsDirty = true;
+}
+
+
+bool MapTileLayer::TileRange::contains(int column, int row) const
+{
+    return column >= minColumn && column < maxColumn
+        && row >= minRow && row < maxRow;
+}
+
+
+bool MapTileLayer::TileRange::operator == (const TileRange& range) const
+{
+    return zoom == range.zoom
+        && minColumn == range.minColumn
+        && minRow == range.minRow
+        && maxColumn == range.maxColumn
+        && maxRow == range.maxRow;
+}
+
+
+bool MapTileLayer::TileRange::operator != (const TileRange& range) const
+{
+    return !(*this == range);
 }
 
 
@@ -336,25 +514,47 @@ TileKey MapTileLayer::keyForCoordinate(const TileCoordinate& coordinate) const
 }
 
 
+PackedTileKey MapTileLayer::packedKeyForCoordinate(const TileCoordinate& coordinate) const
+{
+    return PackedTileKey::fromSetIndex(coordinate.getFlooredColumn(),
+                                       coordinate.getFlooredRow(),
+                                       coordinate.getFlooredZoom(),
+                                       _setIndex);
+}
+
+
+void MapTileLayer::eraseOutstandingRequest(const TileKey& key)
+{
+    // Keys that can't be packed were never requested by a layer.
+    if (PackedTileKey::canPack(key))
+    {
+        _outstandingRequests.erase(PackedTileKey(key));
+    }
+}
+
+
 bool MapTileLayer::hasTile(const TileCoordinate& coordinate) const
 {
-    return _tiles->has(keyForCoordinate(coordinate));
+    return _tiles->hasResident(packedKeyForCoordinate(coordinate));
 }
 
 
 std::shared_ptr<Tile> MapTileLayer::getTile(const TileCoordinate& coordinate) const
 {
-    return _tiles->get(keyForCoordinate(coordinate));
+    return _tiles->getResident(packedKeyForCoordinate(coordinate));
 }
 
 
 void MapTileLayer::cancelQueuedRequests() const
 {
-    for (const auto& requestId: _outstandingRequests)
+    // Cancelling may erase from _outstandingRequests, so iterate a copy.
+    auto requestIds = _outstandingRequests;
+
+    for (const auto& requestId: requestIds)
     {
         try
         {
-            _tiles->cancelQueuedRequest(requestId);
+            _tiles->cancelQueuedRequest(requestId.toTileKey());
         }
         catch (const std::exception& exc)
         {
@@ -364,39 +564,152 @@ void MapTileLayer::cancelQueuedRequests() const
 }
 
 
-void MapTileLayer::requestTiles(const std::set<TileCoordinate>& coordinates) const
+void MapTileLayer::requestTiles(const std::vector<TileCoordinate>& coordinates) const
 {
-    //cancelQueuedRequests();
+    std::unordered_set<PackedTileKey> keys;
+
+    for (const auto& coordinate: coordinates)
+    {
+        keys.insert(packedKeyForCoordinate(coordinate));
+    }
+
+    // Cancel queued requests that have left the padded viewport. Cancelling
+    // may erase from _outstandingRequests, so collect the keys first.
+    std::vector<PackedTileKey> keysToCancel;
+
+    for (const auto& key: _outstandingRequests)
+    {
+        if (keys.find(key) == keys.end())
+        {
+            keysToCancel.push_back(key);
+        }
+    }
+
+    for (const auto& key: keysToCancel)
+    {
+        try
+        {
+            _tiles->cancelQueuedRequest(key.toTileKey());
+        }
+        catch (const std::exception& exc)
+        {
+            // The request is already running and will complete normally.
+        }
+    }
 
-    std::vector<TileCoordinate> coordinatesToRequest(coordinates.begin(),
-                                                     coordinates.end());
+    // Sort in reverse so the nearest coordinate can be popped from the back.
+    _pendingCoordinates.assign(coordinates.begin(), coordinates.end());
 
     QueueSorter sorter(_center);
 
-    std::sort(coordinatesToRequest.begin(),
-              coordinatesToRequest.end(),
+    std::sort(_pendingCoordinates.rbegin(),
+              _pendingCoordinates.rend(),
               sorter);
 
-    for (const auto& coordinate: coordinatesToRequest)
+    submitPendingRequests();
+}
+
+
+void MapTileLayer::submitPendingRequests() const
+{
+    std::vector<std::pair<PackedTileKey, TileKey>> requests;
+
+    while (!_pendingCoordinates.empty()
+        && _outstandingRequests.size() < _maxOutstandingRequests)
+    {
+        auto packedKey = packedKeyForCoordinate(_pendingCoordinates.back());
+
+        if (_outstandingRequests.find(packedKey) != _outstandingRequests.end())
+        {
+            _pendingCoordinates.pop_back();
+            continue;
+        }
+
+        auto key = keyForCoordinate(_pendingCoordinates.back());
+        _pendingCoordinates.pop_back();
+
+        // Another layer sharing the tile set may already be loading it, and
+        // tiles that recently failed are retried later.
+        if (_tiles->isLoading(key)
+         || _tiles->has(key)
+         || _tiles->isBackingOff(key))
+        {
+            scheduleRetry();
+            continue;
+        }
+
+        _outstandingRequests.insert(packedKey);
+        requests.push_back(std::make_pair(packedKey, key));
+    }
+
+    if (requests.empty())
+    {
+        return;
+    }
+
+    // Read the cached tiles of the whole group with one connection.
+    std::vector<TileKey> keys;
+    keys.reserve(requests.size());
+
+    for (const auto& request: requests)
+    {
+        keys.push_back(request.second);
+    }
+
+    _tiles->batchCacheReads(keys);
+
+    for (const auto& request: requests)
     {
         try
         {
-            auto key = keyForCoordinate(coordinate);
-            _tiles->request(key);
-            _outstandingRequests.insert(key);
+            _tiles->request(request.second);
         }
         catch (const Poco::ExistsException& exc)
         {
-            //std::cout << exc.displayText() << endl;
+            _outstandingRequests.erase(request.first);
         }
     }
 }
 
 
+void MapTileLayer::scheduleRetry() const
+{
+    if (_retryTime == 0)
+    {
+        _retryTime = ofGetElapsedTimeMillis() + RETRY_INTERVAL;
+    }
+}
+
+
 void MapTileLayer::onTileCached(const std::pair<TileKey, std::shared_ptr<Tile>>& args)
 {
 //    std::cout << "tile cached!" << std::endl;
-    _coordsDirty = true;
+    eraseOutstandingRequest(args.first);
+
+    const TileKey& key = args.first;
+
+    // Move a newly loaded visible tile to the drawing queue without
+    // recalculating the rest of the view.
+    if (key.setId() == _setId
+     && key.zoom() == _visibleRange.zoom
+     && _visibleRange.contains(key.column(), key.row()))
+    {
+        TileCoordinate coord(key.column(), key.row(), key.zoom());
+
+        auto iter = std::find(_missingCoords.begin(), _missingCoords.end(), coord);
+
+        if (iter != _missingCoords.end())
+        {
+            _missingCoords.erase(iter);
+            _visibleCoords.push_back(coord);
+        }
+    }
+
+    // The tile may be a better substitute for a missing tile.
+    if (key.setId() == _setId && !_missingCoords.empty())
+    {
+        _fallbacksDirty = true;
+    }
 }
 
 
@@ -409,21 +722,23 @@ void MapTileLayer::onTileUncached(const TileKey& args)
 
 void MapTileLayer::onTileRequestCancelled(const TileKey& key)
 {
-    _outstandingRequests.erase(key);
+    eraseOutstandingRequest(key);
 }
 
 
 void MapTileLayer::onTileRequestFailed(const Cache::RequestFailedArgs<TileKey>& args)
 {
     ofLogError("MapTileLayer::onTileRequestFailed") << "Failed to load " << args.key().toString() << ": " << args.error();
-    _outstandingRequests.erase(args.key());
+    eraseOutstandingRequest(args.key());
+    scheduleRetry();
 }
 
 
 void MapTileLayer::setSetId(const std::string& setId)
 {
     _setId = setId;
-    _coordsDirty = true;
+    _setIndex = PackedTileKey::internSetId(_setId);
+    invalidateVisibleCoordinates();
 }
 
 
@@ -8,6 +8,11 @@
 #include "ofx/Maps/MapTileProvider.h"
 #include "Poco/NumberFormatter.h"
 #include "Poco/String.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <sstream>
 #include "ofx/IO/Hash.h"
 #include "ofLog.h"
 #include "ofMath.h"
@@ -155,26 +160,182 @@ Geo::Coordinate MapTileProvider::tileToGeo(const TileCoordinate& coordinate) con
 
 std::string MapTileProvider::getTileURI(const TileKey& key) const
 {
-    std::size_t index = static_cast<std::size_t>(ofRandom(_URITemplates.size()));
+    std::string tileURI;
+    renderTileURI(key, tileURI);
+    return tileURI;
+}
 
-    auto tileURI = _URITemplates[index];
-    auto templateParameters = _URITemplateParameters[index];
 
-    for (const auto& templateParameter: templateParameters)
+std::size_t MapTileProvider::renderTileURI(const TileKey& key, std::string& uri) const
+{
+    if (_compiledURITemplates.empty())
     {
-        std::string templateValue;
+        uri.clear();
+        return 0;
+    }
+
+    std::size_t index = selectMirror(key);
+
+    const auto& compiledTemplate = _compiledURITemplates[index];
+
+    static const std::string NO_SUBDOMAIN;
+
+    // Spread neighboring tiles across subdomains, as most clients do.
+    const std::string& subdomain = _subdomains.empty() ? NO_SUBDOMAIN
+                                 : _subdomains[static_cast<std::size_t>(std::abs(key.column() + key.row())) % _subdomains.size()];
+
+    compiledTemplate.render(key,
+                            subdomain,
+                            _retinaSuffix,
+                            _isTMS,
+                            [this, &key](const std::string& templateParameter, std::string& templateValue)
+                            {
+                                if (getTileURITemplateValue(key, templateParameter, templateValue))
+                                {
+                                    return true;
+                                }
+
+                                ofLogWarning("MapTileProvider::getTileURI") << "Ignoring unknown template parameter: " << templateParameter;
+                                return false;
+                            },
+                            uri);
+
+    return index;
+}
+
+
+void MapTileProvider::setMirrorSelection(MirrorSelection mirrorSelection)
+{
+    std::unique_lock<std::mutex> lock(_mirrorHealth->mutex);
+    _mirrorSelection = mirrorSelection;
+}
+
+
+MapTileProvider::MirrorSelection MapTileProvider::getMirrorSelection() const
+{
+    std::unique_lock<std::mutex> lock(_mirrorHealth->mutex);
+    return _mirrorSelection;
+}
+
+
+std::size_t MapTileProvider::selectMirror(const TileKey& key) const
+{
+    std::size_t numMirrors = _compiledURITemplates.size();
+
+    if (numMirrors < 2)
+    {
+        return 0;
+    }
+
+    // Hash only the tile's position so that all requests for it agree.
+    std::size_t keyHash = 0;
+    IO::Hash::combine(keyHash, key.column());
+    IO::Hash::combine(keyHash, key.row());
+    IO::Hash::combine(keyHash, key.zoom());
+    IO::Hash::combine(keyHash, key.setId());
 
-        if (getTileURITemplateValue(key, templateParameter, templateValue))
+    // The selection is set from the main thread while loaders read it.
+    std::unique_lock<std::mutex> lock(_mirrorHealth->mutex);
+
+    bool isAdaptive = _mirrorSelection == MirrorSelection::ADAPTIVE;
+
+    // Weighted rendezvous hashing. Adding or removing a mirror, or a change
+    // in one mirror's weight, only moves the tiles that must move.
+    std::size_t bestMirror = 0;
+    double bestScore = -std::numeric_limits<double>::infinity();
+
+    for (std::size_t i = 0; i < numMirrors; ++i)
+    {
+        double weight = 1.0;
+
+        if (isAdaptive && i < _mirrorHealth->mirrors.size())
         {
-            Poco::replaceInPlace(tileURI, templateParameter, templateValue);
+            const auto& health = _mirrorHealth->mirrors[i];
+            double latency = health.latency > 0 ? health.latency : DEFAULT_MIRROR_LATENCY;
+            weight = 1.0 / (std::max(latency, 1.0) * (1.0 + 20.0 * health.errorRate));
         }
-        else
+
+        uint64_t h = static_cast<uint64_t>(keyHash) ^ ((i + 1) * 0x9E3779B97F4A7C15ull);
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+        h = h ^ (h >> 31);
+
+        // A uniform value in (0, 1).
+        double u = (static_cast<double>(h >> 11) + 0.5) / 9007199254740992.0;
+        double score = -weight / std::log(u);
+
+        if (score > bestScore)
         {
-            ofLogWarning("MapTileProvider::getTileURI") << "Ignoring unknown template parameter: " << templateParameter;
+            bestScore = score;
+            bestMirror = i;
         }
     }
 
-    return tileURI;
+    return bestMirror;
+}
+
+
+void MapTileProvider::reportMirrorResult(std::size_t mirror,
+                                         double milliseconds,
+                                         bool success) const
+{
+    if (_mirrorHealth == nullptr)
+    {
+        return;
+    }
+
+    // The weight given to each new sample in the moving averages.
+    const double alpha = 0.2;
+
+    std::unique_lock<std::mutex> lock(_mirrorHealth->mutex);
+
+    if (mirror >= _mirrorHealth->mirrors.size())
+    {
+        return;
+    }
+
+    auto& health = _mirrorHealth->mirrors[mirror];
+
+    ++health.numRequests;
+
+    if (success)
+    {
+        health.latency = health.latency > 0 ? (1 - alpha) * health.latency + alpha * milliseconds
+                                            : milliseconds;
+        health.errorRate = (1 - alpha) * health.errorRate;
+    }
+    else
+    {
+        ++health.numErrors;
+        health.errorRate = (1 - alpha) * health.errorRate + alpha;
+    }
+}
+
+
+std::string MapTileProvider::mirrorsToString() const
+{
+    std::stringstream ss;
+
+    if (_mirrorHealth != nullptr)
+    {
+        std::unique_lock<std::mutex> lock(_mirrorHealth->mutex);
+
+        for (std::size_t i = 0; i < _mirrorHealth->mirrors.size(); ++i)
+        {
+            const auto& health = _mirrorHealth->mirrors[i];
+            ss << "Mirror " << i << ": ";
+            ss << health.latency << " ms, ";
+            ss << health.errorRate * 100 << "% errors, ";
+            ss << health.numRequests << " requests";
+
+            if (i + 1 < _mirrorHealth->mirrors.size())
+            {
+                ss << std::endl;
+            }
+        }
+    }
+
+    return ss.str();
 }
 
 
@@ -190,6 +351,36 @@ const std::vector<std::string> MapTileProvider::URITemplates() const
 }
 
 
+void MapTileProvider::setSubdomains(const std::vector<std::string>& subdomains)
+{
+    _subdomains = subdomains;
+}
+
+
+std::vector<std::string> MapTileProvider::subdomains() const
+{
+    return _subdomains;
+}
+
+
+void MapTileProvider::setRetinaSuffix(const std::string& retinaSuffix)
+{
+    _retinaSuffix = retinaSuffix;
+}
+
+
+std::string MapTileProvider::retinaSuffix() const
+{
+    return _retinaSuffix;
+}
+
+
+bool MapTileProvider::isTMS() const
+{
+    return _isTMS;
+}
+
+
 std::map<std::string, std::string> MapTileProvider::dictionary() const
 {
     return _dictionary;
@@ -210,7 +401,17 @@ bool MapTileProvider::getTileURITemplateValue(const TileKey& key,
         templateValue = Poco::NumberFormatter::format(static_cast<Poco::Int64>(key.row()));
         return true;
     }
-    if (templateParameter == TileTemplate::TEMPLATE_PARAM_ZOOM)
+    else if (templateParameter == TileTemplate::TEMPLATE_PARAM_TMS_Y)
+    {
+        templateValue = Poco::NumberFormatter::format(static_cast<Poco::Int64>((Poco::Int64(1) << key.zoom()) - 1 - key.row()));
+        return true;
+    }
+    else if (templateParameter == TileTemplate::TEMPLATE_PARAM_QUADKEY)
+    {
+        templateValue = TileTemplate::tileCoordinateToQuadKey(key.column(), key.row(), key.zoom());
+        return true;
+    }
+    else if (templateParameter == TileTemplate::TEMPLATE_PARAM_ZOOM)
     {
         templateValue = Poco::NumberFormatter::format(static_cast<Poco::Int64>(key.zoom()));
         return true;
@@ -250,6 +451,11 @@ void MapTileProvider::_setURITemplates(const std::vector<std::string>& templates
     // Update parameters and generate ID.
     _URITemplates = templates;
     _URITemplateParameters.clear();
+    _compiledURITemplates.clear();
+
+    // Mirror health starts over with new templates.
+    _mirrorHealth = std::make_shared<MirrorHealthTable>();
+    _mirrorHealth->mirrors.resize(templates.size());
 
     std::size_t hash = 0;
 
@@ -257,6 +463,7 @@ void MapTileProvider::_setURITemplates(const std::vector<std::string>& templates
     {
         IO::Hash::combine(hash, _URITemplate);
         _URITemplateParameters.push_back(TileTemplate::extractTemplateParameters(_URITemplate));
+        _compiledURITemplates.push_back(TileURITemplate(_URITemplate));
     }
 
     _id = std::to_string(hash);
@@ -280,7 +487,30 @@ MapTileProvider MapTileProvider::fromJSON(const ofJson& json)
         else if (key == "attribution") provider._attribution = value;
         else if (key == "template") { ofLogWarning("MapTileProvider::fromJSON") << "Unsupported TileJSON field: " << key; }
         else if (key == "legend") { ofLogWarning("MapTileProvider::fromJSON") << "Unsupported TileJSON field: " << key;  }
-        else if (key == "scheme") { ofLogWarning("MapTileProvider::fromJSON") << "Unsupported TileJSON field: " << key;  }
+        else if (key == "scheme") provider._isTMS = (value == "tms");
+        else if (key == "subdomains")
+        {
+            // Accept either "abc" or ["a", "b", "c"].
+            std::vector<std::string> subdomains;
+
+            if (value.is_string())
+            {
+                for (auto c: value.get<std::string>())
+                {
+                    subdomains.push_back(std::string(1, c));
+                }
+            }
+            else
+            {
+                for (const auto& subdomain: value)
+                {
+                    subdomains.push_back(subdomain);
+                }
+            }
+
+            provider._subdomains = subdomains;
+        }
+        else if (key == "retina") provider._retinaSuffix = value.get<bool>() ? "@2x" : "";
         else if (key == "tiles")
         {
             std::vector<std::string> uriTemplates;
@@ -331,7 +561,9 @@ ofJson MapTileProvider::toJSON(const MapTileProvider& provider)
     if (!provider.attribution().empty()) json["attribution"] = provider.attribution();
     // if (!provider.template().empty()) json["template"] = provider.template();
     // if (!provider.legend().empty()) json["legend"] = provider.legend();
-    // if (!provider.scheme().empty()) json["scheme"] = provider.scheme();
+    if (provider.isTMS()) json["scheme"] = "tms";
+    if (!provider.subdomains().empty()) json["subdomains"] = provider.subdomains();
+    if (!provider.retinaSuffix().empty()) json["retina"] = true;
     if (!provider.attribution().empty()) json["tiles"] = provider.URITemplates();
     // if (!provider.grids().empty()) json["grids"] = provider.grids();
     // if (!provider.data().empty()) json["data"] = provider.data();
@@ -6,11 +6,16 @@
 
 
 #include "ofx/Maps/MapTileSet.h"
+#include <algorithm>
+#include <sstream>
 #include "Poco/Net/HTTPResponse.h"
+#include "ofAppRunner.h"
 #include "Poco/Net/MediaType.h"
 #include "ofx/HTTP/Client.h"
 #include "ofx/HTTP/GetRequest.h"
+#include "ofx/Maps/HTTPBodyReader.h"
 #include "ofx/Maps/MBTilesCache.h"
+#include "ofx/Maps/TileDecoder.h"
 
 
 namespace ofx {
@@ -22,47 +27,234 @@ const std::string MapTileSet::DEFAULT_BUFFER_CACHE_LOCATION = "cache";
 
 MapTileSet::MapTileSet(std::size_t cacheSize,
                        std::shared_ptr<MapTileProvider> provider,
-                       std::shared_ptr<TileBufferCache> bufferCache):
+                       std::shared_ptr<TileBufferCache> bufferCache,
+                       std::size_t numDecodeThreads):
 //    Cache::BaseResourceCache<TileKey, Tile>(cacheSize, taskQueue),
     _provider(provider),
     _bufferCache(bufferCache),
-    _onAddListener(this->onAdd.newListener(this, &MapTileSet::_onAdd))
+    _decodePool(numDecodeThreads),
+    _pixelPool(std::make_shared<TilePixelPool>()),
+    _tileResidency(Tile::Residency::BOTH),
+    _memoryStats(std::make_shared<TileMemoryStats>()),
+    _compressedCache(std::make_shared<CompressedTileCache>()),
+    _maxBytes(0),
+    _onAddListener(this->onAdd.newListener(this, &MapTileSet::_onAdd)),
+    _failureJitter(std::random_device()()),
+    _missingTileTTL(DEFAULT_MISSING_TILE_TTL),
+    _numFetches(0),
+    _numDecodes(0),
+    _numCoalesced(0),
+    _numResident(0)
 {
     if (_bufferCache == nullptr && _provider->isCacheable())
     {
         _bufferCache = std::make_shared<MBTilesCache>(*_provider, DEFAULT_BUFFER_CACHE_LOCATION);
     }
+
+    _mbtilesCache = std::dynamic_pointer_cast<MBTilesCache>(_bufferCache);
+
+    _compressedCache->setMemoryStats(_memoryStats);
+
+    // Stale tiles can only be revalidated if freshness is stored.
+    if (_mbtilesCache != nullptr)
+    {
+        _revalidateThread = std::thread(&MapTileSet::_revalidate, this);
+    }
+}
+
+
+MapTileSet::~MapTileSet()
+{
+    _revalidateChannel.close();
+
+    if (_revalidateThread.joinable())
+    {
+        _revalidateThread.join();
+    }
 }
 
 
 std::shared_ptr<Tile> MapTileSet::load(Cache::CacheRequestTask<TileKey, Tile>& task)
 {
-    std::shared_ptr<ofBuffer> buffer = _tryLoadFromCache(task);
+    std::promise<std::shared_ptr<Tile>> promise;
+    std::shared_future<std::shared_ptr<Tile>> future;
+
+    {
+        std::unique_lock<std::mutex> lock(_inFlightMutex);
+
+        auto iter = _inFlight.find(task.key());
+
+        if (iter != _inFlight.end())
+        {
+            future = iter->second;
+        }
+        else
+        {
+            _inFlight[task.key()] = promise.get_future().share();
+        }
+    }
+
+    // Join the load already in flight rather than fetching and decoding again.
+    if (future.valid())
+    {
+        ++_numCoalesced;
+        return future.get();
+    }
+
+    std::shared_ptr<Tile> tile = nullptr;
+
+    try
+    {
+        // A task finishing just before this one was queued may have already
+        // added the tile.
+        tile = get(task.key());
+
+        if (tile != nullptr)
+        {
+            ++_numResident;
+        }
+        else
+        {
+            tile = _load(task);
+        }
+    }
+    catch (...)
+    {
+        promise.set_exception(std::current_exception());
+
+        std::unique_lock<std::mutex> lock(_inFlightMutex);
+        _inFlight.erase(task.key());
+        throw;
+    }
+
+    promise.set_value(tile);
+
+    std::unique_lock<std::mutex> lock(_inFlightMutex);
+    _inFlight.erase(task.key());
+
+    return tile;
+}
+
+
+std::shared_ptr<Tile> MapTileSet::_load(Cache::CacheRequestTask<TileKey, Tile>& task)
+{
+    ofPixels pixels;
+
+    // Recently evicted tiles are decoded again without reading the disk cache.
+    TileFreshness compressedFreshness;
+    auto compressed = _compressedCache->get(task.key(), &compressedFreshness);
+
+    if (compressed != nullptr && _decode(compressed->getData(), compressed->size(), pixels))
+    {
+        if (_mbtilesCache != nullptr && compressedFreshness.isStale())
+        {
+            _queueRevalidation(task.key(), compressedFreshness);
+        }
+
+        return _makeTile(task.key(), pixels);
+    }
+
+    // Tiles requested together were read together.
+    std::shared_ptr<ofBuffer> batched = nullptr;
+    TileFreshness batchedFreshness;
 
-    bool isCached = (buffer != nullptr);
+    if (_takeFromReadBatch(task.key(), batched, batchedFreshness)
+     && _decode(batched->getData(), batched->size(), pixels))
+    {
+        _compressedCache->add(task.key(), batched, batchedFreshness);
+
+        if (batchedFreshness.isStale())
+        {
+            _queueRevalidation(task.key(), batchedFreshness);
+        }
+
+        return _makeTile(task.key(), pixels);
+    }
+
+    if (_tryDecodeFromCache(task, pixels))
+    {
+        return _makeTile(task.key(), pixels);
+    }
+
+    std::shared_ptr<ofBuffer> buffer = nullptr;
+    TileFreshness freshness;
+
+    // The MBTiles cache has already been checked without copying.
+    bool isCached = false;
+
+    if (_mbtilesCache == nullptr)
+    {
+        buffer = _tryLoadFromCache(task);
+        isCached = (buffer != nullptr);
+    }
 
     if (!isCached)
     {
-        buffer = _tryLoadFromURI(task);
+        // Don't ask again for tiles that recently failed or don't exist.
+        if (isBackingOff(task.key()))
+        {
+            _pixelPool->release(std::move(pixels));
+            return nullptr;
+        }
+
+        int64_t missingUntil = 0;
+
+        if (_mbtilesCache != nullptr && _mbtilesCache->isMissing(task.key(), &missingUntil))
+        {
+            _recordFailure(task.key(), true, missingUntil);
+            _pixelPool->release(std::move(pixels));
+            return nullptr;
+        }
+
+        FetchStatus status = FetchStatus::FAILED;
+
+        try
+        {
+            buffer = _tryLoadFromURI(task, freshness, status);
+        }
+        catch (...)
+        {
+            _recordFailure(task.key(), false);
+            throw;
+        }
+
+        if (status == FetchStatus::OK)
+        {
+            _clearFailure(task.key());
+        }
+        else
+        {
+            _recordFailure(task.key(), status == FetchStatus::MISSING);
+        }
     }
 
     if (buffer != nullptr)
     {
-        ofPixels pixels;
-
-        if (!ofLoadImage(pixels, *buffer))
+        if (!_decode(buffer->getData(), buffer->size(), pixels))
         {
             ofLogError("TileStore::load") << "Failure to load pixels.";
+            _pixelPool->release(std::move(pixels));
             return nullptr;
         }
+
+        _compressedCache->add(task.key(), buffer, freshness);
+
+        if (!isCached && _mbtilesCache != nullptr && _provider->isCacheable())
+        {
+            _mbtilesCache->add(task.key(), buffer, freshness);
+        }
         else if (!isCached && _bufferCache != nullptr && _provider->isCacheable())
         {
             _bufferCache->add(task.key(), buffer);
         }
 
-        return std::make_shared<Tile>(pixels);
+        return _makeTile(task.key(), pixels, isCached ? nullptr : buffer);
+    }
+    else
+    {
+        _pixelPool->release(std::move(pixels));
+        return nullptr;
     }
-    else return nullptr;
 }
 
 
@@ -73,6 +265,61 @@ std::string MapTileSet::toTaskId(const TileKey& key) const
 }
 
 
+bool MapTileSet::_tryDecodeFromCache(Cache::CacheRequestTask<TileKey, Tile>& task,
+                                     ofPixels& pixels)
+{
+    if (_mbtilesCache != nullptr)
+    {
+        TileFreshness freshness;
+
+        // Wait for room in the decode queue before taking a read connection,
+        // so a full queue never holds connections idle.
+        _decodePool.reserve();
+        bool isReservationUsed = false;
+
+        // Decode straight from the SQLite blob. The bytes are only copied
+        // when they are promoted to the compressed tier.
+        bool decoded = _mbtilesCache->read(task.key(), [this, &task, &pixels, &freshness, &isReservationUsed](const char* data, std::size_t size)
+                                                       {
+                                                           isReservationUsed = true;
+
+                                                           if (!_decode(data, size, pixels, true))
+                                                           {
+                                                               return false;
+                                                           }
+
+                                                           // Every read refreshes the tier's LRU order.
+                                                           if (_compressedCache->getMaxBytes() > 0)
+                                                           {
+                                                               _compressedCache->add(task.key(), std::make_shared<ofBuffer>(data, size), freshness);
+                                                           }
+
+                                                           return true;
+                                                       },
+                                           &freshness);
+
+        if (!isReservationUsed)
+        {
+            _decodePool.cancelReservation();
+        }
+
+        if (!decoded)
+        {
+            return false;
+        }
+
+        // Serve stale tiles immediately and revalidate in the background.
+        if (freshness.isStale())
+        {
+            _queueRevalidation(task.key(), freshness);
+        }
+
+        return true;
+    }
+    else return false;
+}
+
+
 std::shared_ptr<ofBuffer> MapTileSet::_tryLoadFromCache(Cache::CacheRequestTask<TileKey, Tile>& task)
 {
     if (_bufferCache != nullptr)
@@ -89,47 +336,533 @@ std::shared_ptr<MapTileProvider> MapTileSet::provider() const
 }
 
 
-std::shared_ptr<ofBuffer> MapTileSet::_tryLoadFromURI(Cache::CacheRequestTask<TileKey, Tile>& task)
+HTTPSessionPool& MapTileSet::sessionPool()
 {
-    std::shared_ptr<ofBuffer> buffer = nullptr;
+    return _sessionPool;
+}
 
-    // Launch a thread to go get it!
-    Poco::URI uri = Poco::URI(_provider->getTileURI(task.key()));
 
-    if (uri.getScheme() == "http" || uri.getScheme() == "https")
+HostRateLimiter& MapTileSet::rateLimiter()
+{
+    return _rateLimiter;
+}
+
+
+TileDecodePool& MapTileSet::decodePool()
+{
+    return _decodePool;
+}
+
+
+std::shared_ptr<TilePixelPool> MapTileSet::pixelPool() const
+{
+    return _pixelPool;
+}
+
+
+void MapTileSet::setTileResidency(Tile::Residency residency)
+{
+    _tileResidency = residency;
+}
+
+
+Tile::Residency MapTileSet::getTileResidency() const
+{
+    return _tileResidency;
+}
+
+
+CompressedTileCache& MapTileSet::compressedCache()
+{
+    return *_compressedCache;
+}
+
+
+const TileMemoryStats& MapTileSet::memoryStats() const
+{
+    return *_memoryStats;
+}
+
+
+void MapTileSet::setMaxBytes(uint64_t maxBytes)
+{
+    _maxBytes = maxBytes;
+}
+
+
+uint64_t MapTileSet::getMaxBytes() const
+{
+    return _maxBytes;
+}
+
+
+uint64_t MapTileSet::usedBytes() const
+{
+    // The compressed tier has its own budget.
+    int64_t bytes = _memoryStats->pixelBytes + _memoryStats->textureBytes;
+    return static_cast<uint64_t>(std::max(bytes, int64_t(0)));
+}
+
+
+void MapTileSet::batchCacheReads(const std::vector<TileKey>& keys)
+{
+    // A single tile gains nothing from a batch.
+    if (_mbtilesCache == nullptr || keys.size() < 2)
+    {
+        return;
+    }
+
+    auto batch = std::make_shared<ReadBatch>();
+    batch->keys = keys;
+
+    std::unique_lock<std::mutex> lock(_readBatchesMutex);
+
+    // Batches whose loads were cancelled are never taken, so don't let them
+    // pile up. Abandoned keys just read the cache as usual.
+    if (_readBatches.size() + keys.size() > MAX_BATCHED_READS)
+    {
+        _readBatches.clear();
+    }
+
+    for (const auto& key: keys)
+    {
+        _readBatches[key] = batch;
+    }
+}
+
+
+bool MapTileSet::_takeFromReadBatch(const TileKey& key,
+                                    std::shared_ptr<ofBuffer>& buffer,
+                                    TileFreshness& freshness)
+{
+    std::shared_ptr<ReadBatch> batch = nullptr;
+
+    {
+        std::unique_lock<std::mutex> lock(_readBatchesMutex);
+
+        auto iter = _readBatches.find(key);
+
+        if (iter == _readBatches.end())
+        {
+            return false;
+        }
+
+        batch = iter->second;
+        _readBatches.erase(iter);
+    }
+
+    std::unique_lock<std::mutex> lock(batch->mutex);
+
+    if (!batch->isStarted)
+    {
+        batch->isStarted = true;
+        lock.unlock();
+
+        // Other loads in the batch wake as their tiles arrive.
+        auto onRead = [batch](const TileKey& readKey,
+                              std::shared_ptr<ofBuffer> readBuffer,
+                              const TileFreshness& readFreshness)
+                      {
+                          std::unique_lock<std::mutex> batchLock(batch->mutex);
+                          batch->results[readKey] = std::make_pair(readBuffer, readFreshness);
+                          batch->condition.notify_all();
+                      };
+
+        try
+        {
+            _mbtilesCache->getMany(batch->keys, onRead);
+        }
+        catch (...)
+        {
+            lock.lock();
+            batch->isFinished = true;
+            batch->condition.notify_all();
+            throw;
+        }
+
+        lock.lock();
+        batch->isFinished = true;
+        batch->condition.notify_all();
+    }
+
+    batch->condition.wait(lock, [batch, &key]()
+                                {
+                                    return batch->isFinished || batch->results.find(key) != batch->results.end();
+                                });
+
+    auto result = batch->results.find(key);
+
+    if (result == batch->results.end() || result->second.first == nullptr)
+    {
+        return false;
+    }
+
+    buffer = result->second.first;
+    freshness = result->second.second;
+    batch->results.erase(result);
+    return true;
+}
+
+
+bool MapTileSet::hasResident(const PackedTileKey& key) const
+{
+    auto iter = _packedTiles.find(key);
+    return iter != _packedTiles.end() && !iter->second.second.expired();
+}
+
+
+std::shared_ptr<Tile> MapTileSet::getResident(const PackedTileKey& key)
+{
+    auto iter = _packedTiles.find(key);
+
+    if (iter == _packedTiles.end())
     {
-        HTTP::Client client;
-        HTTP::Context context;
-        HTTP::GetRequest request(uri.toString());
+        return nullptr;
+    }
+
+    auto tile = get(iter->second.first);
+
+    if (tile == nullptr)
+    {
+        _packedTiles.erase(iter);
+    }
+
+    return tile;
+}
+
+
+bool MapTileSet::isLoading(const TileKey& key) const
+{
+    std::unique_lock<std::mutex> lock(_inFlightMutex);
+    return _inFlight.find(key) != _inFlight.end();
+}
+
+
+uint64_t MapTileSet::numFetches() const
+{
+    return _numFetches;
+}
+
+
+uint64_t MapTileSet::numDecodes() const
+{
+    return _numDecodes;
+}
+
+
+uint64_t MapTileSet::numCoalesced() const
+{
+    return _numCoalesced;
+}
+
+
+uint64_t MapTileSet::numResident() const
+{
+    return _numResident;
+}
 
-        auto listener = context.events.onHTTPClientResponseProgress.newListener([&task](HTTP::ClientResponseProgressEventArgs& args)
-                                                                                {
-                                                                                    task.setProgress(args.progress().progress());
-                                                                                });
 
-        auto response = client.execute(context, request);
+std::string MapTileSet::toString() const
+{
+    std::size_t numInFlight = 0;
+
+    {
+        std::unique_lock<std::mutex> lock(_inFlightMutex);
+        numInFlight = _inFlight.size();
+    }
+
+    std::stringstream ss;
+    ss << "In Flight: " << numInFlight;
+    ss << " Fetches: " << _numFetches;
+    ss << " Decodes: " << _numDecodes;
+    ss << " Coalesced: " << _numCoalesced;
+    ss << " Resident: " << _numResident;
+
+    {
+        std::unique_lock<std::mutex> lock(_failuresMutex);
+        ss << " Failures: " << _failures.size();
+    }
+
+    ss << " " << _decodePool.toString();
+    ss << " " << _pixelPool->toString();
+    ss << " Pixel Bytes: " << _memoryStats->pixelBytes;
+    ss << " Texture Bytes: " << _memoryStats->textureBytes;
+    ss << " Compressed Bytes: " << _memoryStats->compressedBytes;
+    ss << " Budget: " << _maxBytes;
+    ss << " " << _compressedCache->toString();
+    return ss.str();
+}
+
+
+bool MapTileSet::isBackingOff(const TileKey& key) const
+{
+    std::unique_lock<std::mutex> lock(_failuresMutex);
+    auto iter = _failures.find(key);
+    return iter != _failures.end() && Poco::Timestamp() < iter->second.retryAt;
+}
+
+
+void MapTileSet::setMissingTileTTL(uint64_t seconds)
+{
+    _missingTileTTL = seconds;
+}
+
+
+uint64_t MapTileSet::getMissingTileTTL() const
+{
+    return _missingTileTTL;
+}
+
+
+void MapTileSet::_recordFailure(const TileKey& key,
+                                bool isMissing,
+                                int64_t expiresDate)
+{
+    Poco::Timestamp now;
+    Poco::Timestamp::TimeDiff backoff = 0;
+
+    {
+        std::unique_lock<std::mutex> lock(_failuresMutex);
 
-        if (response->getStatus() == Poco::Net::HTTPResponse::HTTP_OK)
+        // Drop expired records rather than letting the table grow forever.
+        if (_failures.size() >= MAX_FAILURE_RECORDS && _failures.find(key) == _failures.end())
         {
-            Poco::Net::MediaType mediaType(response->getContentType());
+            auto soonest = _failures.end();
 
-            if (mediaType.matches("image"))
+            for (auto iter = _failures.begin(); iter != _failures.end();)
             {
-                buffer = std::make_shared<ofBuffer>(response->stream());
+                if (iter->second.retryAt <= now)
+                {
+                    iter = _failures.erase(iter);
+                }
+                else
+                {
+                    if (soonest == _failures.end() || iter->second.retryAt < soonest->second.retryAt)
+                    {
+                        soonest = iter;
+                    }
+
+                    ++iter;
+                }
             }
-            else
+
+            // Still full, so forget the record that would expire first.
+            if (_failures.size() >= MAX_FAILURE_RECORDS && soonest != _failures.end())
             {
-                ofLogError("TileStore::_tryLoadFromURI") << "Unsupported media type: " << mediaType.toString();
+                _failures.erase(soonest);
             }
         }
+
+        FailureRecord& record = _failures[key];
+        ++record.numFailures;
+
+        if (isMissing && expiresDate > 0)
+        {
+            // Already persisted, so keep the stored expiry.
+            record.retryAt = Poco::Timestamp::fromEpochTime(expiresDate);
+            return;
+        }
+        else if (isMissing)
+        {
+            backoff = Poco::Timestamp::TimeDiff(_missingTileTTL) * Poco::Timestamp::resolution();
+        }
         else
         {
-            ofLogError("TileStore::_tryLoadFromURI") << "Invalid response: " << response->getStatus() << ": " << response->getReason() << ": " << uri.toString();
+            // Double the backoff for each failure, then jitter it so tiles
+            // that failed together aren't all retried together.
+            uint64_t milliseconds = DEFAULT_MAX_RETRY_BACKOFF;
 
-            buffer = std::make_shared<ofBuffer>(response->stream());
-            std::cout << buffer->getText() << std::endl;
+            if (record.numFailures <= 16)
+            {
+                milliseconds = std::min(uint64_t(DEFAULT_RETRY_BACKOFF) << (record.numFailures - 1),
+                                        uint64_t(DEFAULT_MAX_RETRY_BACKOFF));
+            }
 
+            std::uniform_real_distribution<double> jitter(0.5, 1.0);
+            backoff = Poco::Timestamp::TimeDiff(milliseconds * jitter(_failureJitter) * 1000);
         }
+
+        record.retryAt = now + backoff;
+    }
+
+    // Remember missing tiles across runs.
+    if (isMissing && _mbtilesCache != nullptr && _provider->isCacheable())
+    {
+        _mbtilesCache->addMissing(key, (now + backoff).epochTime());
+    }
+}
+
+
+void MapTileSet::_clearFailure(const TileKey& key)
+{
+    std::unique_lock<std::mutex> lock(_failuresMutex);
+    _failures.erase(key);
+}
+
+
+std::shared_ptr<ofBuffer> MapTileSet::_tryLoadFromURI(Cache::CacheRequestTask<TileKey, Tile>& task,
+                                                      TileFreshness& freshness,
+                                                      FetchStatus& status)
+{
+    ++_numFetches;
+    return _fetch(task.key(), nullptr, freshness, status, &task);
+}
+
+
+std::shared_ptr<ofBuffer> MapTileSet::_fetch(const TileKey& key,
+                                             const TileFreshness* validators,
+                                             TileFreshness& freshness,
+                                             FetchStatus& status,
+                                             Cache::CacheRequestTask<TileKey, Tile>* task)
+{
+    std::shared_ptr<ofBuffer> buffer = nullptr;
+
+    status = FetchStatus::FAILED;
+
+    // Launch a thread to go get it!
+    std::string uriString;
+    std::size_t mirror = _provider->renderTileURI(key, uriString);
+    Poco::URI uri(uriString);
+
+    if (uri.getScheme() == "http" || uri.getScheme() == "https")
+    {
+        // Wait for the host's rate and concurrency limits.
+        std::string hostKey = HTTPSessionPool::hostKey(uri);
+        _rateLimiter.acquire(hostKey);
+
+        // The host's slot is held until the body is read and must be released
+        // on every path.
+        HostRateLimiter::Outcome outcome = HostRateLimiter::Outcome::FAILED;
+        double milliseconds = 0;
+        double retryAfter = 0;
+        Poco::Timestamp start;
+
+        try
+        {
+            // Reuse a keep-alive session for this host if one is idle.
+            auto session = _sessionPool.borrowSession(uri);
+
+            HTTP::Client& client = session->client;
+            HTTP::Context& context = session->context;
+            HTTP::GetRequest request(uri.toString());
+            request.setKeepAlive(true);
+
+            // The session can only be reused once the response is fully read.
+            bool reusable = false;
+
+            if (validators != nullptr)
+            {
+                if (!validators->eTag.empty())
+                {
+                    request.set("If-None-Match", validators->eTag);
+                }
+
+                if (!validators->lastModified.empty())
+                {
+                    request.set("If-Modified-Since", validators->lastModified);
+                }
+            }
+
+            ofEventListener listener;
+
+            if (task != nullptr)
+            {
+                listener = context.events.onHTTPClientResponseProgress.newListener([task](HTTP::ClientResponseProgressEventArgs& args)
+                                                                                   {
+                                                                                       task->setProgress(args.progress().progress());
+                                                                                   });
+            }
+
+            try
+            {
+                auto response = client.execute(context, request);
+
+                // Server errors and throttling count against the mirror and
+                // slow down requests to the host.
+                milliseconds = start.elapsed() / 1000.0;
+                outcome = HostRateLimiter::outcomeFor(*response);
+                retryAfter = HostRateLimiter::retryAfterSeconds(*response);
+
+                if (response->getStatus() == Poco::Net::HTTPResponse::HTTP_OK)
+                {
+                    Poco::Net::MediaType mediaType(response->getContentType());
+
+                    if (mediaType.matches("image"))
+                    {
+                        // The same buffer is shared by the decoder and the caches.
+                        buffer = HTTPBodyReader::read(*response, response->stream());
+
+                        if (buffer == nullptr)
+                        {
+                            outcome = HostRateLimiter::Outcome::FAILED;
+                            ofLogError("TileStore::_tryLoadFromURI") << "Truncated or oversized response: " << uri.toString();
+                        }
+                        else if (buffer->size() == 0)
+                        {
+                            // Some servers answer empty areas with an empty image.
+                            buffer = nullptr;
+                            status = FetchStatus::MISSING;
+                            reusable = response->getKeepAlive();
+                        }
+                        else
+                        {
+                            freshness = TileFreshness::fromResponse(*response);
+                            status = FetchStatus::OK;
+                            reusable = response->getKeepAlive();
+                        }
+                    }
+                    else
+                    {
+                        ofLogError("TileStore::_tryLoadFromURI") << "Unsupported media type: " << mediaType.toString();
+                        reusable = HTTPBodyReader::discard(response->stream()) && response->getKeepAlive();
+                    }
+                }
+                else if (validators != nullptr && response->getStatus() == Poco::Net::HTTPResponse::HTTP_NOT_MODIFIED)
+                {
+                    status = FetchStatus::NOT_MODIFIED;
+                    freshness = TileFreshness::fromNotModified(*response, *validators);
+                    reusable = response->getKeepAlive();
+                }
+                else if (response->getStatus() == Poco::Net::HTTPResponse::HTTP_NOT_FOUND
+                      || response->getStatus() == Poco::Net::HTTPResponse::HTTP_GONE
+                      || response->getStatus() == Poco::Net::HTTPResponse::HTTP_NO_CONTENT)
+                {
+                    // Drain the body so the session can be reused.
+                    status = FetchStatus::MISSING;
+                    reusable = HTTPBodyReader::discard(response->stream()) && response->getKeepAlive();
+                }
+                else
+                {
+                    ofLogError("TileStore::_tryLoadFromURI") << "Invalid response: " << response->getStatus() << ": " << response->getReason() << ": " << uri.toString();
+
+                    // Only the start of an error page is worth keeping.
+                    std::string body;
+                    reusable = HTTPBodyReader::discard(response->stream(), &body) && response->getKeepAlive();
+                    ofLogVerbose("TileStore::_tryLoadFromURI") << body;
+                }
+            }
+            catch (...)
+            {
+                listener.unsubscribe();
+                _sessionPool.returnSession(std::move(session), false);
+                throw;
+            }
+
+            // Detach progress reporting before another task can borrow the session.
+            listener.unsubscribe();
+            _sessionPool.returnSession(std::move(session), reusable);
+        }
+        catch (...)
+        {
+            // Anything after the acquire that throws still frees the slot.
+            milliseconds = start.elapsed() / 1000.0;
+            _provider->reportMirrorResult(mirror, milliseconds, false);
+            _rateLimiter.release(hostKey, HostRateLimiter::Outcome::FAILED, milliseconds);
+            throw;
+        }
+
+        _provider->reportMirrorResult(mirror, milliseconds, outcome == HostRateLimiter::Outcome::SUCCESS);
+        _rateLimiter.release(hostKey, outcome, milliseconds, retryAfter, status == FetchStatus::OK);
     }
     else
     {
@@ -140,10 +873,250 @@ std::shared_ptr<ofBuffer> MapTileSet::_tryLoadFromURI(Cache::CacheRequestTask<Ti
 }
 
 
+std::shared_ptr<Tile> MapTileSet::_makeTile(const TileKey& key,
+                                            ofPixels& pixels,
+                                            std::shared_ptr<ofBuffer> unpersisted)
+{
+    auto tile = std::make_shared<Tile>(std::move(pixels), _pixelPool);
+    tile->setResidency(_tileResidency);
+    tile->setMemoryStats(_memoryStats);
+
+    // Released pixels can only be decoded again from a buffer cache.
+    if (_bufferCache != nullptr && _provider->isCacheable())
+    {
+        std::weak_ptr<TileBufferCache> weakBufferCache = _bufferCache;
+        std::weak_ptr<CompressedTileCache> weakCompressedCache = _compressedCache;
+        std::shared_ptr<TilePixelPool> pixelPool = _pixelPool;
+        glm::vec2 tileSize = _provider->tileSize();
+
+        tile->setPixelSource([weakBufferCache, weakCompressedCache, pixelPool, tileSize, key, unpersisted](ofPixels& pixels) mutable
+                             {
+                                 auto decode = [&](const char* data, std::size_t size)
+                                               {
+                                                   std::size_t channels = TileDecoder::sniffChannels(data, size);
+                                                   pixels = pixelPool->acquire(tileSize.x, tileSize.y, channels);
+                                                   return TileDecoder::decode(data, size, pixels);
+                                               };
+
+                                 auto compressedCache = weakCompressedCache.lock();
+
+                                 if (compressedCache != nullptr)
+                                 {
+                                     auto compressed = compressedCache->get(key);
+
+                                     if (compressed != nullptr && decode(compressed->getData(), compressed->size()))
+                                     {
+                                         return true;
+                                     }
+                                 }
+
+                                 auto bufferCache = weakBufferCache.lock();
+
+                                 if (bufferCache != nullptr)
+                                 {
+                                     auto mbtilesCache = std::dynamic_pointer_cast<MBTilesCache>(bufferCache);
+
+                                     if (mbtilesCache != nullptr && mbtilesCache->read(key, decode))
+                                     {
+                                         // The write has landed, so the bytes are no longer needed.
+                                         unpersisted = nullptr;
+                                         return true;
+                                     }
+                                     else if (mbtilesCache == nullptr)
+                                     {
+                                         auto buffer = bufferCache->get(key);
+
+                                         if (buffer != nullptr && decode(buffer->getData(), buffer->size()))
+                                         {
+                                             unpersisted = nullptr;
+                                             return true;
+                                         }
+                                     }
+                                 }
+
+                                 // The cache write may still be queued.
+                                 return unpersisted != nullptr && decode(unpersisted->getData(), unpersisted->size());
+                             });
+    }
+
+    return tile;
+}
+
+
+bool MapTileSet::_decode(const char* data,
+                         std::size_t size,
+                         ofPixels& pixels,
+                         bool isReserved)
+{
+    if (!pixels.isAllocated())
+    {
+        std::size_t channels = TileDecoder::sniffChannels(data, size);
+        glm::vec2 tileSize = _provider->tileSize();
+        pixels = _pixelPool->acquire(tileSize.x, tileSize.y, channels);
+    }
+
+    ++_numDecodes;
+    return isReserved ? _decodePool.decodeReserved(data, size, pixels)
+                      : _decodePool.decode(data, size, pixels);
+}
+
+
+void MapTileSet::_queueRevalidation(const TileKey& key,
+                                    const TileFreshness& freshness)
+{
+    std::unique_lock<std::mutex> lock(_revalidatingMutex);
+
+    // Only revalidate each tile once at a time.
+    if (_revalidating.insert(key).second)
+    {
+        _revalidateChannel.send(std::make_pair(key, freshness));
+    }
+}
+
+
+void MapTileSet::_revalidate()
+{
+    std::pair<TileKey, TileFreshness> value;
+
+    while (_revalidateChannel.receive(value))
+    {
+        try
+        {
+            TileFreshness freshness;
+            FetchStatus status = FetchStatus::FAILED;
+
+            auto buffer = _fetch(value.first, &value.second, freshness, status, nullptr);
+
+            // A stale tile is kept if revalidation fails or it went missing.
+            if (status == FetchStatus::NOT_MODIFIED)
+            {
+                // Unchanged, so only bump the dates. The compressed copy
+                // holds the old dates, so it's read again from the cache.
+                _compressedCache->remove(value.first);
+                _mbtilesCache->refresh(value.first, freshness);
+            }
+            else if (buffer != nullptr)
+            {
+                // The new image is used the next time the tile is loaded.
+                _compressedCache->remove(value.first);
+                _mbtilesCache->replace(value.first, buffer, freshness);
+            }
+        }
+        catch (const std::exception& exc)
+        {
+            ofLogError("MapTileSet::_revalidate") << "Failed to revalidate " << value.first.toString() << ": " << exc.what();
+        }
+
+        std::unique_lock<std::mutex> lock(_revalidatingMutex);
+        _revalidating.erase(value.first);
+    }
+}
+
+
 void MapTileSet::_onAdd(const std::pair<TileKey, std::shared_ptr<Tile>>& args)
 {
     // We get a callback when it's cached (in the main thread), so we load it.
     args.second->loadTexture();
+
+    if (PackedTileKey::canPack(args.first))
+    {
+        _packedTiles[PackedTileKey(args.first)] = std::make_pair(args.first, std::weak_ptr<Tile>(args.second));
+
+        // Tiles evicted by the entry count leave expired entries behind.
+        if (_packedTiles.size() >= _packedTilesSweepSize)
+        {
+            auto iter = _packedTiles.begin();
+
+            while (iter != _packedTiles.end())
+            {
+                if (iter->second.second.expired())
+                {
+                    iter = _packedTiles.erase(iter);
+                }
+                else
+                {
+                    ++iter;
+                }
+            }
+
+            _packedTilesSweepSize = std::max(2 * _packedTiles.size(), std::size_t(256));
+        }
+    }
+
+    if (_maxBytes > 0)
+    {
+        _residentTiles[args.first] = args.second;
+        _enforceMaxBytes();
+    }
+    else
+    {
+        _residentTiles.clear();
+    }
+}
+
+
+void MapTileSet::_enforceMaxBytes()
+{
+    uint64_t maxBytes = _maxBytes;
+
+    if (maxBytes == 0 || usedBytes() <= maxBytes)
+    {
+        return;
+    }
+
+    uint64_t frame = ofGetFrameNum();
+
+    // Weight each tile by its size and the frames since it was last drawn.
+    std::vector<std::pair<double, TileKey>> candidates;
+
+    auto iter = _residentTiles.begin();
+
+    while (iter != _residentTiles.end())
+    {
+        auto tile = iter->second.lock();
+
+        if (tile == nullptr)
+        {
+            // Already evicted by the entry count.
+            iter = _residentTiles.erase(iter);
+            continue;
+        }
+
+        // Tiles are added before the frame is drawn, so anything drawn in
+        // the previous frame is still on screen.
+        if (tile->lastUsedFrame() + 1 < frame)
+        {
+            uint64_t tileBytes = tile->pixelBytes() + tile->textureBytes();
+            double age = static_cast<double>(frame - tile->lastUsedFrame());
+            candidates.push_back(std::make_pair(age * static_cast<double>(tileBytes), iter->first));
+        }
+
+        ++iter;
+    }
+
+    std::sort(candidates.begin(),
+              candidates.end(),
+              [](const std::pair<double, TileKey>& a, const std::pair<double, TileKey>& b)
+              {
+                  return a.first > b.first;
+              });
+
+    for (const auto& candidate: candidates)
+    {
+        remove(candidate.second);
+        _residentTiles.erase(candidate.second);
+
+        if (PackedTileKey::canPack(candidate.second))
+        {
+            _packedTiles.erase(PackedTileKey(candidate.second));
+        }
+
+        // Removing a tile only frees its memory if nothing else holds it.
+        if (usedBytes() <= maxBytes)
+        {
+            break;
+        }
+    }
 }
 
 
@@ -0,0 +1,245 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/PackedTileKey.h"
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+
+namespace ofx {
+namespace Maps {
+
+
+/// \brief The interned set ids.
+///
+/// Set ids are never removed, so references into the deque stay valid.
+struct PackedTileKey::SetIdTable
+{
+    SetIdTable()
+    {
+        ids.push_back(TileKey::DEFAULT_SET_ID);
+        indices[TileKey::DEFAULT_SET_ID] = 0;
+    }
+
+    std::deque<std::string> ids;
+    std::unordered_map<std::string, uint32_t> indices;
+    std::mutex mutex;
+};
+
+
+PackedTileKey::PackedTileKey()
+{
+}
+
+
+PackedTileKey::PackedTileKey(int64_t column,
+                             int64_t row,
+                             int64_t zoom,
+                             const std::string& setId):
+    _code((uint64_t(zoom) << ZOOM_SHIFT)
+        | ((_spreadBits(uint64_t(column)) | (_spreadBits(uint64_t(row)) << 1)) & ((uint64_t(1) << ZOOM_SHIFT) - 1))),
+    _setIndex(internSetId(setId))
+{
+}
+
+
+PackedTileKey::PackedTileKey(const TileKey& key):
+    PackedTileKey(key.column(), key.row(), key.zoom(), key.setId())
+{
+}
+
+
+int64_t PackedTileKey::column() const
+{
+    return int64_t(_gatherBits(_morton()));
+}
+
+
+int64_t PackedTileKey::row() const
+{
+    return int64_t(_gatherBits(_morton() >> 1));
+}
+
+
+int64_t PackedTileKey::zoom() const
+{
+    return int64_t(_code >> ZOOM_SHIFT);
+}
+
+
+const std::string& PackedTileKey::setId() const
+{
+    return setIdForIndex(_setIndex);
+}
+
+
+uint64_t PackedTileKey::code() const
+{
+    return _code;
+}
+
+
+uint32_t PackedTileKey::setIndex() const
+{
+    return _setIndex;
+}
+
+
+TileKey PackedTileKey::toTileKey() const
+{
+    return TileKey(column(), row(), zoom(), setId());
+}
+
+
+std::string PackedTileKey::toString() const
+{
+    std::stringstream ss;
+    ss << column() << ",";
+    ss << row() << ",";
+    ss << zoom() << ",";
+    ss << setId();
+    return ss.str();
+}
+
+
+std::size_t PackedTileKey::hash() const
+{
+    // A 64-bit mix, so keys differing only in low bits spread evenly.
+    uint64_t value = _code ^ (uint64_t(_setIndex) * 0x9E3779B97F4A7C15);
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCD;
+    value ^= value >> 33;
+    return std::size_t(value);
+}
+
+
+bool PackedTileKey::operator < (const PackedTileKey& key) const
+{
+    if (_setIndex != key._setIndex)
+    {
+        return _setIndex < key._setIndex;
+    }
+
+    return _code < key._code;
+}
+
+
+bool PackedTileKey::operator == (const PackedTileKey& key) const
+{
+    return _code == key._code && _setIndex == key._setIndex;
+}
+
+
+bool PackedTileKey::operator != (const PackedTileKey& key) const
+{
+    return !(*this == key);
+}
+
+
+bool PackedTileKey::canPack(const TileKey& key)
+{
+    if (key.zoom() < 0 || key.zoom() > MAX_ZOOM || !key.tileId().empty())
+    {
+        return false;
+    }
+
+    int64_t size = int64_t(1) << key.zoom();
+
+    return key.column() >= 0 && key.column() < size
+        && key.row() >= 0 && key.row() < size;
+}
+
+
+PackedTileKey PackedTileKey::fromSetIndex(int64_t column,
+                                          int64_t row,
+                                          int64_t zoom,
+                                          uint32_t setIndex)
+{
+    PackedTileKey key(column, row, zoom);
+    key._setIndex = setIndex;
+    return key;
+}
+
+
+uint32_t PackedTileKey::internSetId(const std::string& setId)
+{
+    if (setId.empty())
+    {
+        return 0;
+    }
+
+    SetIdTable& table = _setIdTable();
+    std::unique_lock<std::mutex> lock(table.mutex);
+
+    auto iter = table.indices.find(setId);
+
+    if (iter != table.indices.end())
+    {
+        return iter->second;
+    }
+
+    uint32_t setIndex = uint32_t(table.ids.size());
+    table.ids.push_back(setId);
+    table.indices[setId] = setIndex;
+    return setIndex;
+}
+
+
+const std::string& PackedTileKey::setIdForIndex(uint32_t setIndex)
+{
+    SetIdTable& table = _setIdTable();
+    std::unique_lock<std::mutex> lock(table.mutex);
+
+    if (setIndex < table.ids.size())
+    {
+        return table.ids[setIndex];
+    }
+
+    return TileKey::DEFAULT_SET_ID;
+}
+
+
+PackedTileKey::SetIdTable& PackedTileKey::_setIdTable()
+{
+    static SetIdTable table;
+    return table;
+}
+
+
+uint64_t PackedTileKey::_spreadBits(uint64_t value)
+{
+    value &= 0x00000000FFFFFFFF;
+    value = (value | (value << 16)) & 0x0000FFFF0000FFFF;
+    value = (value | (value << 8)) & 0x00FF00FF00FF00FF;
+    value = (value | (value << 4)) & 0x0F0F0F0F0F0F0F0F;
+    value = (value | (value << 2)) & 0x3333333333333333;
+    value = (value | (value << 1)) & 0x5555555555555555;
+    return value;
+}
+
+
+uint64_t PackedTileKey::_gatherBits(uint64_t value)
+{
+    value &= 0x5555555555555555;
+    value = (value | (value >> 1)) & 0x3333333333333333;
+    value = (value | (value >> 2)) & 0x0F0F0F0F0F0F0F0F;
+    value = (value | (value >> 4)) & 0x00FF00FF00FF00FF;
+    value = (value | (value >> 8)) & 0x0000FFFF0000FFFF;
+    value = (value | (value >> 16)) & 0x00000000FFFFFFFF;
+    return value;
+}
+
+
+uint64_t PackedTileKey::_morton() const
+{
+    return _code & ((uint64_t(1) << ZOOM_SHIFT) - 1);
+}
+
+
+} } // namespace ofx::Maps
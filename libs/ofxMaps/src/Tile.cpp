@@ -6,6 +6,8 @@
 
 
 #include "ofx/Maps/Tile.h"
+#include "ofAppRunner.h"
+#include "ofLog.h"
 
 
 namespace ofx {
@@ -13,38 +15,78 @@ namespace Maps {
 
 
 Tile::Tile():
-    _type(Type::EMPTY)
+    _type(Type::EMPTY),
+    _lastUsedFrame(0)
 {
 }
 
 
 Tile::Tile(const ofPixels& pixels):
     _type(Type::RASTER),
+    _width(pixels.getWidth()),
+    _height(pixels.getHeight()),
+    _lastUsedFrame(0),
     _pixels(pixels)
 {
 }
 
 
+Tile::Tile(ofPixels&& pixels, std::shared_ptr<TilePixelPool> pool):
+    _type(Type::RASTER),
+    _width(pixels.getWidth()),
+    _height(pixels.getHeight()),
+    _lastUsedFrame(0),
+    _pixels(std::move(pixels)),
+    _pixelPool(pool)
+{
+}
+
+
 Tile::~Tile()
 {
+    _releasePixels();
+    _texture.clear();
+    _textureBytes = 0;
+    _updateMemoryStats();
 }
 
 
 void Tile::draw(float x, float y, float width, float height) const
 {
+    _lastUsedFrame = ofGetFrameNum();
+
+    if (!_texture.isAllocated())
+    {
+        _uploadTexture();
+    }
+
     _texture.draw(x, y, width, height);
 }
 
+
+void Tile::drawSubsection(float x, float y, float width, float height,
+                          float sx, float sy, float sw, float sh) const
+{
+    _lastUsedFrame = ofGetFrameNum();
+
+    if (!_texture.isAllocated())
+    {
+        _uploadTexture();
+    }
+
+    _texture.drawSubsection(x, y, width, height, sx, sy, sw, sh);
+}
+
     
 float Tile::getWidth() const
 {
-    return _pixels.getWidth();
+    return _width;
 }
 
 
 float Tile::getHeight() const
 {
-    return _pixels.getHeight();
+    return _height;
 }
 
 
@@ -56,6 +98,18 @@ bool Tile::empty() const
 
 const ofPixels& Tile::pixels() const
 {
+    std::unique_lock<std::recursive_mutex> lock(_mutex);
+
+    if (!_pixels.isAllocated() && _pixelSource)
+    {
+        if (!_pixelSource(_pixels))
+        {
+            ofLogError("Tile::pixels") << "Unable to decode released pixels.";
+        }
+
+        _updateMemoryStats();
+    }
+
     return _pixels;
 }
 
@@ -78,15 +132,138 @@ bool Tile::hasTexture() const
 }
 
 
+bool Tile::hasPixels() const
+{
+    std::unique_lock<std::recursive_mutex> lock(_mutex);
+    return _pixels.isAllocated();
+}
+
+
 void Tile::loadTexture()
 {
-    _texture.loadData(_pixels);
+    if (_residency == Residency::PIXELS)
+    {
+        return;
+    }
+
+    _lastUsedFrame = ofGetFrameNum();
+    _uploadTexture();
 }
 
 
 void Tile::clearTexture()
 {
+    std::unique_lock<std::recursive_mutex> lock(_mutex);
     _texture.clear();
+    _textureBytes = 0;
+    _updateMemoryStats();
+}
+
+
+void Tile::setResidency(Residency residency)
+{
+    _residency = residency;
+}
+
+
+Tile::Residency Tile::residency() const
+{
+    return _residency;
+}
+
+
+void Tile::setPixelSource(PixelSource source)
+{
+    std::unique_lock<std::recursive_mutex> lock(_mutex);
+    _pixelSource = source;
+}
+
+
+void Tile::setMemoryStats(std::shared_ptr<TileMemoryStats> stats)
+{
+    std::unique_lock<std::recursive_mutex> lock(_mutex);
+
+    if (_memoryStats != nullptr)
+    {
+        _memoryStats->pixelBytes -= _countedPixelBytes;
+        _memoryStats->textureBytes -= _countedTextureBytes;
+    }
+
+    _countedPixelBytes = 0;
+    _countedTextureBytes = 0;
+    _memoryStats = stats;
+    _updateMemoryStats();
+}
+
+
+std::size_t Tile::pixelBytes() const
+{
+    std::unique_lock<std::recursive_mutex> lock(_mutex);
+    return _pixels.isAllocated() ? _pixels.getTotalBytes() : 0;
+}
+
+
+std::size_t Tile::textureBytes() const
+{
+    std::unique_lock<std::recursive_mutex> lock(_mutex);
+    return _textureBytes;
+}
+
+
+uint64_t Tile::lastUsedFrame() const
+{
+    return _lastUsedFrame;
+}
+
+
+void Tile::_uploadTexture() const
+{
+    std::unique_lock<std::recursive_mutex> lock(_mutex);
+
+    const ofPixels& pixelsToLoad = pixels();
+
+    if (!pixelsToLoad.isAllocated())
+    {
+        return;
+    }
+
+    _texture.loadData(pixelsToLoad);
+    _textureBytes = pixelsToLoad.getTotalBytes();
+
+    // Only release pixels that can be decoded again.
+    if (_residency == Residency::TEXTURE && _pixelSource)
+    {
+        _releasePixels();
+    }
+
+    _updateMemoryStats();
+}
+
+
+void Tile::_releasePixels() const
+{
+    if (_pixelPool != nullptr)
+    {
+        _pixelPool->release(std::move(_pixels));
+    }
+
+    _pixels.clear();
+}
+
+
+void Tile::_updateMemoryStats() const
+{
+    if (_memoryStats != nullptr)
+    {
+        std::size_t pixels = pixelBytes();
+        std::size_t texture = textureBytes();
+
+        _memoryStats->pixelBytes += static_cast<int64_t>(pixels) - static_cast<int64_t>(_countedPixelBytes);
+        _memoryStats->textureBytes += static_cast<int64_t>(texture) - static_cast<int64_t>(_countedTextureBytes);
+
+        _countedPixelBytes = pixels;
+        _countedTextureBytes = texture;
+    }
 }
 
 
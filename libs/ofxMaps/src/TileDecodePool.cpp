@@ -0,0 +1,201 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/TileDecodePool.h"
+#include <algorithm>
+#include <sstream>
+#include "ofx/Maps/TileDecoder.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+TileDecodePool::TileDecodePool(std::size_t numThreads,
+                               std::size_t maxQueueSize):
+    _maxQueueSize(std::max(maxQueueSize, std::size_t(1)))
+{
+    if (numThreads == 0)
+    {
+        numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    for (std::size_t i = 0; i < numThreads; ++i)
+    {
+        _threads.push_back(std::thread(&TileDecodePool::_run, this));
+    }
+}
+
+
+TileDecodePool::~TileDecodePool()
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _isRunning = false;
+    }
+
+    _notEmpty.notify_all();
+    _notFull.notify_all();
+
+    for (auto& thread: _threads)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+}
+
+
+bool TileDecodePool::decode(const char* data,
+                            std::size_t size,
+                            ofPixels& pixels)
+{
+    reserve();
+    return decodeReserved(data, size, pixels);
+}
+
+
+void TileDecodePool::reserve()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _notFull.wait(lock, [this]()
+                        {
+                            return !_isRunning || _queue.size() + _numReserved < _maxQueueSize;
+                        });
+
+    ++_numReserved;
+}
+
+
+bool TileDecodePool::decodeReserved(const char* data,
+                                    std::size_t size,
+                                    ofPixels& pixels)
+{
+    std::packaged_task<bool()> task([data, size, &pixels]()
+                                    {
+                                        return TileDecoder::decode(data, size, pixels);
+                                    });
+
+    std::future<bool> result = task.get_future();
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        _numReserved -= std::min(_numReserved, std::size_t(1));
+
+        // Decode on the calling thread rather than fail during shutdown.
+        if (!_isRunning)
+        {
+            lock.unlock();
+            return TileDecoder::decode(data, size, pixels);
+        }
+
+        _queue.push_back(std::move(task));
+        _maxQueueDepth = std::max(_maxQueueDepth, _queue.size());
+    }
+
+    _notEmpty.notify_one();
+
+    return result.get();
+}
+
+
+void TileDecodePool::cancelReservation()
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _numReserved -= std::min(_numReserved, std::size_t(1));
+    }
+
+    _notFull.notify_one();
+}
+
+
+std::size_t TileDecodePool::numThreads() const
+{
+    return _threads.size();
+}
+
+
+void TileDecodePool::setMaxQueueSize(std::size_t maxQueueSize)
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _maxQueueSize = std::max(maxQueueSize, std::size_t(1));
+    }
+
+    _notFull.notify_all();
+}
+
+
+std::size_t TileDecodePool::getMaxQueueSize() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _maxQueueSize;
+}
+
+
+std::size_t TileDecodePool::queueDepth() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _queue.size();
+}
+
+
+std::size_t TileDecodePool::maxQueueDepth() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _maxQueueDepth;
+}
+
+
+std::string TileDecodePool::toString() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    std::stringstream ss;
+    ss << "Decode Threads: " << _threads.size();
+    ss << " Queue: " << _queue.size() << "/" << _maxQueueSize;
+    ss << " Peak: " << _maxQueueDepth;
+    return ss.str();
+}
+
+
+void TileDecodePool::_run()
+{
+    while (true)
+    {
+        std::packaged_task<bool()> task;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            _notEmpty.wait(lock, [this]()
+                                 {
+                                     return !_isRunning || !_queue.empty();
+                                 });
+
+            // Finish queued decodes before stopping so no caller is left waiting.
+            if (_queue.empty())
+            {
+                return;
+            }
+
+            task = std::move(_queue.front());
+            _queue.pop_front();
+        }
+
+        _notFull.notify_one();
+
+        task();
+    }
+}
+
+
+} } // namespace ofx::Maps
@@ -0,0 +1,289 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/TileDecoder.h"
+#include <cstdint>
+#include <cstring>
+#include "FreeImage.h"
+#include "ofLog.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+std::string FreeImageTileDecoder::name() const
+{
+    return "FreeImage";
+}
+
+
+bool FreeImageTileDecoder::canDecode(TileFormat) const
+{
+    // FreeImage sniffs the format itself, so let it try anything.
+    return true;
+}
+
+
+bool FreeImageTileDecoder::decode(const char* data,
+                                  std::size_t size,
+                                  ofPixels& pixels) const
+{
+    // FreeImage reads directly from the given memory without copying it.
+    FIMEMORY* memory = FreeImage_OpenMemory(reinterpret_cast<BYTE*>(const_cast<char*>(data)),
+                                            static_cast<DWORD>(size));
+
+    if (memory == nullptr)
+    {
+        ofLogError("FreeImageTileDecoder::decode") << "Unable to open memory.";
+        return false;
+    }
+
+    FIBITMAP* bitmap = nullptr;
+
+    FREE_IMAGE_FORMAT format = FreeImage_GetFileTypeFromMemory(memory, static_cast<int>(size));
+
+    if (format != FIF_UNKNOWN && FreeImage_FIFSupportsReading(format))
+    {
+        bitmap = FreeImage_LoadFromMemory(format, memory, 0);
+    }
+
+    FreeImage_CloseMemory(memory);
+
+    if (bitmap == nullptr)
+    {
+        ofLogError("FreeImageTileDecoder::decode") << "Unable to decode image.";
+        return false;
+    }
+
+    // Expand palettized and sub-byte images, as ofLoadImage() does.
+    unsigned int bpp = FreeImage_GetBPP(bitmap);
+
+    if (FreeImage_GetColorType(bitmap) == FIC_PALETTE || (bpp != 8 && bpp != 24 && bpp != 32))
+    {
+        FIBITMAP* converted = FreeImage_IsTransparent(bitmap) ? FreeImage_ConvertTo32Bits(bitmap)
+                                                              : FreeImage_ConvertTo24Bits(bitmap);
+        FreeImage_Unload(bitmap);
+        bitmap = converted;
+
+        if (bitmap == nullptr)
+        {
+            ofLogError("FreeImageTileDecoder::decode") << "Unable to convert image.";
+            return false;
+        }
+
+        bpp = FreeImage_GetBPP(bitmap);
+    }
+
+    unsigned int width = FreeImage_GetWidth(bitmap);
+    unsigned int height = FreeImage_GetHeight(bitmap);
+    std::size_t channels = bpp / 8;
+
+    // Reuse the caller's pixels if they already have the right shape.
+    if (pixels.getWidth() != width
+     || pixels.getHeight() != height
+     || pixels.getNumChannels() != channels)
+    {
+        pixels.allocate(width, height, channels);
+    }
+
+    FreeImage_ConvertToRawBits(pixels.getData(),
+                               bitmap,
+                               static_cast<int>(width * channels),
+                               bpp,
+                               FI_RGBA_RED_MASK,
+                               FI_RGBA_GREEN_MASK,
+                               FI_RGBA_BLUE_MASK,
+                               true);
+
+    FreeImage_Unload(bitmap);
+
+#if FREEIMAGE_COLORORDER == FREEIMAGE_COLORORDER_BGR
+    if (channels >= 3)
+    {
+        pixels.swapRgb();
+    }
+#endif
+
+    return true;
+}
+
+
+bool TileDecoder::decode(const char* data, std::size_t size, ofPixels& pixels)
+{
+    if (data == nullptr || size == 0)
+    {
+        return false;
+    }
+
+    auto decoder = decoderFor(sniff(data, size));
+
+    if (decoder == nullptr)
+    {
+        ofLogError("TileDecoder::decode") << "No decoder for image.";
+        return false;
+    }
+
+    return decoder->decode(data, size, pixels);
+}
+
+
+TileFormat TileDecoder::sniff(const char* data, std::size_t size)
+{
+    if (data == nullptr)
+    {
+        return TileFormat::UNKNOWN;
+    }
+
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+
+    if (size >= 8 && std::memcmp(bytes, "\x89PNG\r\n\x1a\n", 8) == 0)
+    {
+        return TileFormat::PNG;
+    }
+    else if (size >= 3 && bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF)
+    {
+        return TileFormat::JPEG;
+    }
+    else if (size >= 12 && std::memcmp(bytes, "RIFF", 4) == 0 && std::memcmp(bytes + 8, "WEBP", 4) == 0)
+    {
+        return TileFormat::WEBP;
+    }
+    else if (size >= 6 && (std::memcmp(bytes, "GIF87a", 6) == 0 || std::memcmp(bytes, "GIF89a", 6) == 0))
+    {
+        return TileFormat::GIF;
+    }
+
+    return TileFormat::UNKNOWN;
+}
+
+
+std::size_t TileDecoder::sniffChannels(const char* data, std::size_t size)
+{
+    TileFormat format = sniff(data, size);
+
+    if (format == TileFormat::JPEG)
+    {
+        return 3;
+    }
+    else if (format != TileFormat::PNG || size < 33)
+    {
+        return 4;
+    }
+
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+
+    // The IHDR chunk always comes first, so the bit depth and color type are
+    // at fixed offsets.
+    unsigned char bitDepth = bytes[24];
+    unsigned char colorType = bytes[25];
+
+    switch (colorType)
+    {
+        case 0: // Grayscale.
+            if (bitDepth == 8)
+            {
+                return 1;
+            }
+            break;
+        case 2: // RGB.
+            return 3;
+        case 3: // Palette.
+            break;
+        default: // Grayscale with alpha or RGBA.
+            return 4;
+    }
+
+    // Palette and sub-byte grayscale images are expanded to RGBA only if they
+    // have a tRNS chunk, which must come before the image data.
+    std::size_t offset = 8;
+
+    while (offset + 8 <= size)
+    {
+        uint32_t length = (uint32_t(bytes[offset]) << 24)
+                        | (uint32_t(bytes[offset + 1]) << 16)
+                        | (uint32_t(bytes[offset + 2]) << 8)
+                        |  uint32_t(bytes[offset + 3]);
+
+        const char* type = data + offset + 4;
+
+        if (std::memcmp(type, "tRNS", 4) == 0)
+        {
+            return 4;
+        }
+        else if (std::memcmp(type, "IDAT", 4) == 0)
+        {
+            break;
+        }
+
+        // Skip the length, type, data and CRC.
+        offset += std::size_t(length) + 12;
+    }
+
+    return 3;
+}
+
+
+void TileDecoder::registerDecoder(std::shared_ptr<AbstractTileDecoder> decoder)
+{
+    if (decoder == nullptr)
+    {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex());
+
+    // Decoding threads keep using their snapshot while the list is replaced.
+    auto decoders = std::make_shared<Decoders>(*_registered());
+    decoders->insert(decoders->begin(), decoder);
+    _registered() = decoders;
+}
+
+
+void TileDecoder::resetDecoders()
+{
+    std::unique_lock<std::mutex> lock(_mutex());
+    _registered() = std::make_shared<const Decoders>(Decoders { std::make_shared<FreeImageTileDecoder>() });
+}
+
+
+std::shared_ptr<AbstractTileDecoder> TileDecoder::decoderFor(TileFormat format)
+{
+    for (const auto& decoder: *_decoders())
+    {
+        if (decoder->canDecode(format))
+        {
+            return decoder;
+        }
+    }
+
+    return nullptr;
+}
+
+
+std::shared_ptr<const TileDecoder::Decoders> TileDecoder::_decoders()
+{
+    std::unique_lock<std::mutex> lock(_mutex());
+    return _registered();
+}
+
+
+std::mutex& TileDecoder::_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+
+std::shared_ptr<const TileDecoder::Decoders>& TileDecoder::_registered()
+{
+    static std::shared_ptr<const Decoders> decoders = std::make_shared<const Decoders>(Decoders { std::make_shared<FreeImageTileDecoder>() });
+    return decoders;
+}
+
+
+} } // namespace ofx::Maps
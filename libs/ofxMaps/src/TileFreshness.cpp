@@ -0,0 +1,114 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/TileFreshness.h"
+#include <algorithm>
+#include "Poco/DateTimeParser.h"
+#include "Poco/NumberParser.h"
+#include "Poco/String.h"
+#include "Poco/StringTokenizer.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+bool TileFreshness::isStale(const Poco::Timestamp& now) const
+{
+    return expiresDate != 0 && now.epochTime() >= expiresDate;
+}
+
+
+bool TileFreshness::hasValidators() const
+{
+    return !eTag.empty() || !lastModified.empty();
+}
+
+
+TileFreshness TileFreshness::fromResponse(const Poco::Net::HTTPResponse& response,
+                                          const Poco::Timestamp& now)
+{
+    TileFreshness freshness;
+
+    freshness.cachedDate = now.epochTime();
+    freshness.eTag = response.get("ETag", "");
+    freshness.lastModified = response.get("Last-Modified", "");
+
+    bool hasCacheControl = false;
+
+    if (response.has("Cache-Control"))
+    {
+        Poco::StringTokenizer directives(response.get("Cache-Control"),
+                                         ",",
+                                         Poco::StringTokenizer::TOK_TRIM | Poco::StringTokenizer::TOK_IGNORE_EMPTY);
+
+        for (const auto& directive: directives)
+        {
+            std::string name = Poco::toLower(directive);
+
+            if (name == "no-cache" || name == "no-store")
+            {
+                // Keep the tile, but revalidate it every time it is loaded.
+                freshness.expiresDate = freshness.cachedDate;
+                hasCacheControl = true;
+                break;
+            }
+            else if (Poco::startsWith(name, std::string("max-age=")))
+            {
+                int maxAge = 0;
+
+                if (Poco::NumberParser::tryParse(name.substr(8), maxAge))
+                {
+                    freshness.expiresDate = freshness.cachedDate + std::max(maxAge, 0);
+                    hasCacheControl = true;
+                }
+            }
+        }
+    }
+
+    if (!hasCacheControl && response.has("Expires"))
+    {
+        Poco::DateTime expires;
+        int timeZoneDifferential = 0;
+
+        if (Poco::DateTimeParser::tryParse(response.get("Expires"), expires, timeZoneDifferential))
+        {
+            expires.makeUTC(timeZoneDifferential);
+            freshness.expiresDate = expires.timestamp().epochTime();
+        }
+        else
+        {
+            // Invalid dates, such as "0", mean already expired.
+            freshness.expiresDate = freshness.cachedDate;
+        }
+    }
+
+    return freshness;
+}
+
+
+TileFreshness TileFreshness::fromNotModified(const Poco::Net::HTTPResponse& response,
+                                             const TileFreshness& previous,
+                                             const Poco::Timestamp& now)
+{
+    TileFreshness freshness = fromResponse(response, now);
+
+    // Without a new lifetime, a zero expiry would mean the tile is never
+    // revalidated again.
+    if (freshness.expiresDate == 0
+     && previous.expiresDate != 0
+     && previous.cachedDate != 0)
+    {
+        int64_t lifetime = previous.expiresDate - previous.cachedDate;
+        freshness.expiresDate = freshness.cachedDate + std::max(lifetime, int64_t(0));
+    }
+
+    return freshness;
+}
+
+
+} } // namespace ofx::Maps
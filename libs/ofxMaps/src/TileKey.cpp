@@ -7,6 +7,7 @@
 
 #include "ofx/Maps/TileKey.h"
 #include <sstream>
+#include <utility>
 #include "ofx/IO/Hash.h"
 
 
@@ -79,13 +80,13 @@ int64_t TileKey::zoom() const
 //}
 
 
-std::string TileKey::tileId() const
+const std::string& TileKey::tileId() const
 {
     return _tileId;
 }
 
 
-std::string TileKey::setId() const
+const std::string& TileKey::setId() const
 {
     return _setId;
 }
@@ -110,14 +111,100 @@ std::size_t TileKey::hash() const
     IO::Hash::combine(seed, _row);
     IO::Hash::combine(seed, _zoom);
 //    IO::Hash::combine(hash, _providerId);
-    IO::Hash::combine(seed, _tileId);
-    IO::Hash::combine(seed, _setId);
+
+    // Most keys have no ids, so skip hashing empty strings.
+    if (!_tileId.empty())
+    {
+        IO::Hash::combine(seed, _tileId);
+    }
+
+    if (!_setId.empty())
+    {
+        IO::Hash::combine(seed, _setId);
+    }
+
     return seed;
 }
 
 
 
 
+uint64_t TileKey::hilbertIndex() const
+{
+    return hilbertIndex(_column, _row, _zoom);
+}
+
+
+uint64_t TileKey::hilbertIndex(int64_t column, int64_t row, int64_t zoom)
+{
+    if (zoom < 0 || zoom > 31)
+    {
+        return 0;
+    }
+
+    uint64_t n = uint64_t(1) << zoom;
+    uint64_t x = uint64_t(column) & (n - 1);
+    uint64_t y = uint64_t(row) & (n - 1);
+    uint64_t index = 0;
+
+    for (uint64_t s = n / 2; s > 0; s /= 2)
+    {
+        uint64_t rx = (x & s) > 0 ? 1 : 0;
+        uint64_t ry = (y & s) > 0 ? 1 : 0;
+
+        index += s * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the curve stays continuous.
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+
+            std::swap(x, y);
+        }
+    }
+
+    return index;
+}
+
+
+bool TileKey::HilbertOrder::operator () (const TileKey& key0, const TileKey& key1) const
+{
+    if (key0.setId() != key1.setId())
+    {
+        return key0.setId() < key1.setId();
+    }
+    else if (key0.zoom() != key1.zoom())
+    {
+        return key0.zoom() < key1.zoom();
+    }
+
+    uint64_t index0 = key0.hilbertIndex();
+    uint64_t index1 = key1.hilbertIndex();
+
+    if (index0 != index1)
+    {
+        return index0 < index1;
+    }
+    else if (key0.column() != key1.column())
+    {
+        // Columns and rows outside the zoom level wrap onto the same index.
+        return key0.column() < key1.column();
+    }
+    else if (key0.row() != key1.row())
+    {
+        return key0.row() < key1.row();
+    }
+    else
+    {
+        return key0.tileId() < key1.tileId();
+    }
+}
+
+
 bool TileKey::operator < (const TileKey& key) const
 {
     /*
@@ -125,27 +212,43 @@ bool TileKey::operator < (const TileKey& key) const
     {
         return _providerId < key.providerId();
     }
-    else */if (_setId != key.setId())
+    else */if (_row != key._row)
     {
-        return _setId < key.setId();
+        return _row < key._row;
     }
-    else if (_tileId != key.tileId())
+    else if (_column != key._column)
     {
-        return _tileId < key.tileId();
+        return _column < key._column;
     }
-    else if (_row != key.row())
+    else if (_zoom != key._zoom)
     {
-        return _row < key.row();
+        return _zoom < key._zoom;
     }
-    else if (_column != key.column())
+    else if (_setId != key._setId)
     {
-        return _column < key.column();
+        return _setId < key._setId;
     }
     else
     {
-        return _zoom < key.zoom();
+        return _tileId < key._tileId;
     }
 }
 
 
+bool TileKey::operator == (const TileKey& key) const
+{
+    return _column == key._column
+        && _row == key._row
+        && _zoom == key._zoom
+        && _setId == key._setId
+        && _tileId == key._tileId;
+}
+
+
+bool TileKey::operator != (const TileKey& key) const
+{
+    return !(*this == key);
+}
+
+
 } } // namespace ofx::Maps
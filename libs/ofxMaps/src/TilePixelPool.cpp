@@ -0,0 +1,126 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/TilePixelPool.h"
+#include <sstream>
+
+
+namespace ofx {
+namespace Maps {
+
+
+TilePixelPool::TilePixelPool(std::size_t maxBuffersPerShape):
+    _maxBuffersPerShape(maxBuffersPerShape)
+{
+}
+
+
+ofPixels TilePixelPool::acquire(std::size_t width,
+                                std::size_t height,
+                                std::size_t channels)
+{
+    if (isPooled(width, height, channels))
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        auto iter = _buffers.find(Shape(width, height, channels));
+
+        if (iter != _buffers.end() && !iter->second.empty())
+        {
+            ofPixels pixels = std::move(iter->second.back());
+            iter->second.pop_back();
+            ++_numReused;
+            return pixels;
+        }
+
+        ++_numAllocated;
+    }
+
+    ofPixels pixels;
+    pixels.allocate(width, height, channels);
+    return pixels;
+}
+
+
+void TilePixelPool::release(ofPixels&& pixels)
+{
+    if (!pixels.isAllocated())
+    {
+        return;
+    }
+
+    Shape shape(pixels.getWidth(), pixels.getHeight(), pixels.getNumChannels());
+
+    if (isPooled(std::get<0>(shape), std::get<1>(shape), std::get<2>(shape)))
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        auto& buffers = _buffers[shape];
+
+        if (buffers.size() < _maxBuffersPerShape)
+        {
+            buffers.push_back(std::move(pixels));
+            return;
+        }
+    }
+
+    pixels.clear();
+}
+
+
+void TilePixelPool::clear()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _buffers.clear();
+}
+
+
+std::size_t TilePixelPool::size() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    std::size_t size = 0;
+
+    for (const auto& buffers: _buffers)
+    {
+        size += buffers.second.size();
+    }
+
+    return size;
+}
+
+
+std::string TilePixelPool::toString() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    std::size_t numIdle = 0;
+
+    for (const auto& buffers: _buffers)
+    {
+        numIdle += buffers.second.size();
+    }
+
+    std::stringstream ss;
+    ss << "Pixel Pool Idle: " << numIdle;
+    ss << " Reused: " << _numReused;
+    ss << " Allocated: " << _numAllocated;
+    return ss.str();
+}
+
+
+bool TilePixelPool::isPooled(std::size_t width,
+                             std::size_t height,
+                             std::size_t channels)
+{
+    return width == height
+        && (width == 256 || width == 512)
+        && (channels == 3 || channels == 4);
+}
+
+
+} } // namespace ofx::Maps
@@ -0,0 +1,135 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/TilePresenceIndex.h"
+#include <functional>
+
+
+namespace ofx {
+namespace Maps {
+
+
+TilePresenceIndex::TilePresenceIndex(std::size_t capacity)
+{
+    // Round up to a power of two so bit indices can be masked.
+    uint64_t numBits = 64;
+
+    while (numBits < static_cast<uint64_t>(capacity) * BITS_PER_TILE)
+    {
+        numBits <<= 1;
+    }
+
+    _numWords = static_cast<std::size_t>(numBits / 64);
+    _bitMask = numBits - 1;
+    _words.reset(new std::atomic<uint64_t>[_numWords]);
+
+    clear();
+}
+
+
+TilePresenceIndex::~TilePresenceIndex()
+{
+}
+
+
+void TilePresenceIndex::add(int64_t zoom,
+                            int64_t column,
+                            int64_t row,
+                            const std::string& setId)
+{
+    // Keys without a set id match any set, so always add the empty set id.
+    _add(_hash(zoom, column, row, TileKey::DEFAULT_SET_ID));
+
+    if (!setId.empty())
+    {
+        _add(_hash(zoom, column, row, setId));
+    }
+}
+
+
+void TilePresenceIndex::add(const TileKey& key)
+{
+    add(key.zoom(), key.column(), key.row(), key.setId());
+}
+
+
+bool TilePresenceIndex::mayContain(const TileKey& key) const
+{
+    return _test(_hash(key.zoom(), key.column(), key.row(), key.setId()));
+}
+
+
+void TilePresenceIndex::clear()
+{
+    for (std::size_t i = 0; i < _numWords; ++i)
+    {
+        _words[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+
+std::size_t TilePresenceIndex::numBits() const
+{
+    return _numWords * 64;
+}
+
+
+void TilePresenceIndex::_add(uint64_t hash)
+{
+    // Double hashing, h_i = h1 + i * h2.
+    uint64_t h1 = hash;
+    uint64_t h2 = (hash >> 32) | (hash << 32) | 1;
+
+    for (int i = 0; i < NUM_HASHES; ++i)
+    {
+        uint64_t bit = (h1 + i * h2) & _bitMask;
+        _words[bit >> 6].fetch_or(uint64_t(1) << (bit & 63), std::memory_order_relaxed);
+    }
+}
+
+
+bool TilePresenceIndex::_test(uint64_t hash) const
+{
+    uint64_t h1 = hash;
+    uint64_t h2 = (hash >> 32) | (hash << 32) | 1;
+
+    for (int i = 0; i < NUM_HASHES; ++i)
+    {
+        uint64_t bit = (h1 + i * h2) & _bitMask;
+
+        if ((_words[bit >> 6].load(std::memory_order_relaxed) & (uint64_t(1) << (bit & 63))) == 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+uint64_t TilePresenceIndex::_hash(int64_t zoom,
+                                  int64_t column,
+                                  int64_t row,
+                                  const std::string& setId)
+{
+    // splitmix64 finalizer over the packed location and set id hash.
+    uint64_t x = static_cast<uint64_t>(zoom) * 0x9E3779B97F4A7C15ULL;
+    x ^= static_cast<uint64_t>(column) + 0x632BE59BD9B4E019ULL + (x << 6) + (x >> 2);
+    x ^= static_cast<uint64_t>(row) + 0x85157AF5ULL + (x << 6) + (x >> 2);
+
+    if (!setId.empty())
+    {
+        x ^= static_cast<uint64_t>(std::hash<std::string>()(setId)) + (x << 6) + (x >> 2);
+    }
+
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+
+} } // namespace ofx::Maps
@@ -20,6 +20,9 @@ const std::string TileTemplate::TEMPLATE_PARAM_QUADKEY   = "{quadkey}";
 const std::string TileTemplate::TEMPLATE_PARAM_ZOOM      = "{z}";
 const std::string TileTemplate::TEMPLATE_PARAM_X         = "{x}";
 const std::string TileTemplate::TEMPLATE_PARAM_Y         = "{y}";
+const std::string TileTemplate::TEMPLATE_PARAM_TMS_Y     = "{-y}";
+const std::string TileTemplate::TEMPLATE_PARAM_SUBDOMAIN = "{s}";
+const std::string TileTemplate::TEMPLATE_PARAM_RETINA    = "{r}";
 const std::string TileTemplate::TEMPLATE_PARAM_TILE_ID   = "{tile_id}";
 const std::string TileTemplate::TEMPLATE_PARAM_SET_ID    = "{set_id}";
 
@@ -0,0 +1,195 @@
+//
+// Copyright (c) 2014 Christopher Baker <https://christopherbaker.net>
+//
+// SPDX-License-Identifier:	MIT
+//
+
+
+#include "ofx/Maps/TileURITemplate.h"
+#include <algorithm>
+#include "ofx/Maps/TileTemplate.h"
+
+
+namespace ofx {
+namespace Maps {
+
+
+TileURITemplate::TileURITemplate()
+{
+}
+
+
+TileURITemplate::TileURITemplate(const std::string& URITemplate):
+    _source(URITemplate)
+{
+    std::string::size_type offset = 0;
+
+    while (offset < _source.size())
+    {
+        std::string::size_type open = _source.find('{', offset);
+        std::string::size_type close = open == std::string::npos ? std::string::npos : _source.find('}', open);
+
+        if (close == std::string::npos)
+        {
+            open = _source.size();
+        }
+
+        if (open > offset)
+        {
+            _segments.push_back({ SegmentType::LITERAL, _source.substr(offset, open - offset) });
+            _literalLength += open - offset;
+        }
+
+        if (open == _source.size())
+        {
+            break;
+        }
+
+        std::string parameter = _source.substr(open, close - open + 1);
+
+        Segment segment = { SegmentType::CUSTOM, parameter };
+
+        if (parameter == TileTemplate::TEMPLATE_PARAM_X) segment.type = SegmentType::X;
+        else if (parameter == TileTemplate::TEMPLATE_PARAM_Y) segment.type = SegmentType::Y;
+        else if (parameter == TileTemplate::TEMPLATE_PARAM_TMS_Y) segment.type = SegmentType::TMS_Y;
+        else if (parameter == TileTemplate::TEMPLATE_PARAM_ZOOM) segment.type = SegmentType::ZOOM;
+        else if (parameter == TileTemplate::TEMPLATE_PARAM_QUADKEY) segment.type = SegmentType::QUADKEY;
+        else if (parameter == TileTemplate::TEMPLATE_PARAM_SUBDOMAIN) segment.type = SegmentType::SUBDOMAIN;
+        else if (parameter == TileTemplate::TEMPLATE_PARAM_RETINA) segment.type = SegmentType::RETINA;
+        else if (parameter == TileTemplate::TEMPLATE_PARAM_TILE_ID) segment.type = SegmentType::TILE_ID;
+        else if (parameter == TileTemplate::TEMPLATE_PARAM_SET_ID) segment.type = SegmentType::SET_ID;
+
+        if (segment.type == SegmentType::SUBDOMAIN)
+        {
+            _hasSubdomain = true;
+        }
+
+        _segments.push_back(segment);
+
+        offset = close + 1;
+    }
+}
+
+
+void TileURITemplate::render(const TileKey& key,
+                             const std::string& subdomain,
+                             const std::string& retinaSuffix,
+                             bool flipY,
+                             const Resolver& resolver,
+                             std::string& uri) const
+{
+    uri.clear();
+    uri.reserve(_literalLength + 64);
+
+    for (const auto& segment: _segments)
+    {
+        switch (segment.type)
+        {
+            case SegmentType::LITERAL:
+                uri.append(segment.text);
+                break;
+            case SegmentType::X:
+                _appendNumber(key.column(), uri);
+                break;
+            case SegmentType::Y:
+                _appendNumber(flipY ? _tmsRow(key) : key.row(), uri);
+                break;
+            case SegmentType::TMS_Y:
+                _appendNumber(_tmsRow(key), uri);
+                break;
+            case SegmentType::ZOOM:
+                _appendNumber(key.zoom(), uri);
+                break;
+            case SegmentType::QUADKEY:
+            {
+                for (int64_t i = std::min(key.zoom(), int64_t(62)); i > 0; --i)
+                {
+                    int64_t mask = int64_t(1) << (i - 1);
+                    char digit = '0';
+                    if ((key.column() & mask) != 0) digit += 1;
+                    if ((key.row() & mask) != 0) digit += 2;
+                    uri.push_back(digit);
+                }
+                break;
+            }
+            case SegmentType::SUBDOMAIN:
+                uri.append(subdomain);
+                break;
+            case SegmentType::RETINA:
+                uri.append(retinaSuffix);
+                break;
+            case SegmentType::TILE_ID:
+                uri.append(key.tileId());
+                break;
+            case SegmentType::SET_ID:
+                uri.append(key.setId());
+                break;
+            case SegmentType::CUSTOM:
+            {
+                std::string value;
+
+                if (resolver && resolver(segment.text, value))
+                {
+                    uri.append(value);
+                }
+                else
+                {
+                    // Leave unknown parameters in place, as before.
+                    uri.append(segment.text);
+                }
+                break;
+            }
+        }
+    }
+}
+
+
+const std::string& TileURITemplate::source() const
+{
+    return _source;
+}
+
+
+bool TileURITemplate::hasSubdomain() const
+{
+    return _hasSubdomain;
+}
+
+
+int64_t TileURITemplate::_tmsRow(const TileKey& key)
+{
+    if (key.zoom() < 0 || key.zoom() > 62)
+    {
+        return key.row();
+    }
+
+    return (int64_t(1) << key.zoom()) - 1 - key.row();
+}
+
+
+void TileURITemplate::_appendNumber(int64_t value, std::string& uri)
+{
+    if (value < 0)
+    {
+        uri.push_back('-');
+        value = -value;
+    }
+
+    char digits[20];
+    std::size_t length = 0;
+
+    do
+    {
+        digits[length++] = static_cast<char>('0' + value % 10);
+        value /= 10;
+    }
+    while (value > 0);
+
+    while (length > 0)
+    {
+        uri.push_back(digits[--length]);
+    }
+}
+
+
+} } // namespace ofx::Maps